@@ -0,0 +1,172 @@
+/*
+ * accept_bench.c
+ *
+ *  Connections per second: a server process and a number of client
+ *  processes, each of which connects, makes one call and hangs up,
+ *  as fast as it can.
+ *
+ *  accept_bench [-c clients] [-d seconds] [-p port] [-b backlog]
+ *               [-n accept budget] [-u] [-D] [-F]
+ *
+ *  -u uses the io_uring backend, -D sets TCP_DEFER_ACCEPT and -F
+ *  TCP_FASTOPEN on the listener.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "jsonrpc-c.h"
+
+#define REQUEST "{\"jsonrpc\":\"2.0\",\"method\":\"ping\",\"id\":1}\n"
+
+jrpc_server my_server;
+
+typedef struct {
+  long connections;
+  long failures;
+  double latency;   // summed, seconds
+} client_stats;
+
+json_t* ping(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_string("pong");
+}
+
+static
+int serve(int port, jrpc_server_options *options) {
+  if( jrpc_server_init_with_options(&my_server, "127.0.0.1", port,
+                                    EV_DEFAULT, options) != 0 ) {
+    perror("jrpc_server_init");
+    return 1;
+  }
+  jrpc_register_procedure(&my_server, ping, "ping", NULL);
+  jrpc_server_run(&my_server);
+  jrpc_server_destroy(&my_server);
+  return 0;
+}
+
+/* One connection: connect, call, hang up. Returns 0 on success. */
+static
+int one_call(struct sockaddr_in *addr) {
+  struct linger linger = { 1, 0 };
+  char buf[256];
+  ssize_t n;
+  size_t got = 0;
+  int fd, result = -1;
+
+  if( (fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ) {
+    return -1;
+  }
+  /* Reset instead of TIME_WAIT, or the ephemeral ports run out */
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  if( connect(fd, (struct sockaddr*) addr, sizeof(*addr)) == 0 &&
+      write(fd, REQUEST, sizeof(REQUEST) - 1) == sizeof(REQUEST) - 1 ) {
+    while( (n = read(fd, buf + got, sizeof(buf) - got)) > 0 ) {
+      got += n;
+      if( buf[got - 1] == '\n' ) {
+        result = 0;
+        break;
+      }
+    }
+  }
+  close(fd);
+  return result;
+}
+
+static
+void client(int port, double seconds, int out) {
+  struct sockaddr_in addr;
+  client_stats stats = { 0, 0, 0 };
+  ev_tstamp end = ev_time() + seconds, start;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  while( (start = ev_time()) < end ) {
+    if( one_call(&addr) == 0 ) {
+      stats.connections++;
+      stats.latency += ev_time() - start;
+    } else {
+      stats.failures++;
+    }
+  }
+  if( write(out, &stats, sizeof(stats)) != sizeof(stats) ) {
+    exit(1);
+  }
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  jrpc_server_options options;
+  client_stats stats, total = { 0, 0, 0 };
+  int clients = 8, port = 1235, opt, i, fds[2];
+  double seconds = 5;
+  pid_t server;
+
+  memset(&options, 0, sizeof(options));
+  options.listener.nodelay = 1;
+  while( (opt = getopt(argc, argv, "c:d:p:b:n:uDF")) != -1 ) {
+    switch( opt ) {
+    case 'c': clients = atoi(optarg); break;
+    case 'd': seconds = atof(optarg); break;
+    case 'p': port = atoi(optarg); break;
+    case 'b': options.listener.backlog = atoi(optarg); break;
+    case 'n': options.listener.accept_budget = atoi(optarg); break;
+    case 'u': options.backend = JRPC_BACKEND_URING; break;
+    case 'D': options.listener.defer_accept = 1; break;
+    case 'F': options.listener.fastopen = 256; break;
+    default:
+      fprintf(stderr, "usage: %s [-c clients] [-d seconds] [-p port] "
+              "[-b backlog] [-n budget] [-u] [-D] [-F]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if( (server = fork()) == 0 ) {
+    return serve(port, &options);
+  }
+  usleep(200000);
+
+  if( pipe(fds) != 0 ) {
+    perror("pipe");
+    return 1;
+  }
+  for( i = 0; i < clients; i++ ) {
+    if( fork() == 0 ) {
+      close(fds[0]);
+      client(port, seconds, fds[1]);
+    }
+  }
+  close(fds[1]);
+  for( i = 0; i < clients; i++ ) {
+    if( read(fds[0], &stats, sizeof(stats)) != sizeof(stats) ) {
+      break;
+    }
+    total.connections += stats.connections;
+    total.failures += stats.failures;
+    total.latency += stats.latency;
+  }
+  for( i = 0; i < clients; i++ ) {
+    wait(NULL);
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  printf("%ld connections in %.1f s: %.0f connections/s, "
+         "%.1f us per call, %ld failed\n",
+         total.connections, seconds, total.connections / seconds,
+         total.connections > 0 ? total.latency / total.connections * 1e6 : 0,
+         total.failures);
+  return 0;
+}
@@ -0,0 +1,422 @@
+/*
+ * compress_client.c
+ *
+ *  Message compression from the client's side: a server that allows
+ *  deflate and zstd, and a client that negotiates each algorithm
+ *  with "rpc.compress", sends a request as a compressed frame and
+ *  expands the frames of the response.
+ *
+ *  compress_client [-p port] [-n size]
+ *
+ *  -n is the length of the string echoed back, in bytes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "jsonrpc-c.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define COMPRESS_DEFLATE 1
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define COMPRESS_ZSTD 1
+#include <zstd.h>
+#endif
+
+// the algorithms this client was built with
+static const int client_algorithms = 0
+#ifdef COMPRESS_DEFLATE
+  | JRPC_COMPRESSION_DEFLATE
+#endif
+#ifdef COMPRESS_ZSTD
+  | JRPC_COMPRESSION_ZSTD
+#endif
+  ;
+
+// algorithm byte, compressed size, text size
+#define FRAME_HEADER 9
+#define FRAME_TEXT_MAX (1024 * 1024)
+
+jrpc_server my_server;
+
+typedef struct {
+  int fd;
+  // received bytes not yet returned
+  unsigned char *buffer;
+  size_t len;
+  size_t size;
+  // sizes on the wire and as text, for the report
+  size_t wire;
+  size_t text;
+} client;
+
+json_t* echo(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_incref(json_array_get(params, 0));
+}
+
+static
+int serve(int port) {
+  jrpc_server_options options;
+
+  memset(&options, 0, sizeof(options));
+  options.compression = JRPC_COMPRESSION_DEFLATE | JRPC_COMPRESSION_ZSTD;
+  if( jrpc_server_init_with_options(&my_server, "127.0.0.1", port,
+                                    EV_DEFAULT, &options) != 0 ) {
+    perror("jrpc_server_init");
+    return 1;
+  }
+  jrpc_register_procedure(&my_server, echo, "echo", NULL);
+  jrpc_server_run(&my_server);
+  jrpc_server_destroy(&my_server);
+  return 0;
+}
+
+static
+void put_uint32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static
+uint32_t get_uint32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+    (uint32_t) p[2] << 8 | p[3];
+}
+
+//
+// Algorithms
+//
+
+/* Compresses len bytes of text into a new frame. Returns its size,
+   0 on error. */
+static
+size_t compress_frame(int algorithm,
+                      const char *text,
+                      size_t len,
+                      unsigned char **frame) {
+  size_t size = 0;
+
+  switch( algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE: {
+    uLongf n = compressBound(len);
+    if( (*frame = malloc(FRAME_HEADER + n)) == NULL ||
+        compress(*frame + FRAME_HEADER, &n, (const Bytef*) text,
+                 len) != Z_OK ) {
+      free(*frame);
+      return 0;
+    }
+    size = n;
+    break;
+  }
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD: {
+    size_t n = ZSTD_compressBound(len);
+    if( (*frame = malloc(FRAME_HEADER + n)) == NULL ) {
+      return 0;
+    }
+    size = ZSTD_compress(*frame + FRAME_HEADER, n, text, len, 3);
+    if( ZSTD_isError(size) ) {
+      free(*frame);
+      return 0;
+    }
+    break;
+  }
+#endif
+  default:
+    return 0;
+  }
+  (*frame)[0] = algorithm;
+  put_uint32(*frame + 1, size);
+  put_uint32(*frame + 5, len);
+  return FRAME_HEADER + size;
+}
+
+/* Expands a frame's payload into exactly len bytes. Returns 0 on
+   success. */
+static
+int expand_frame(int algorithm,
+                 const unsigned char *in,
+                 size_t in_len,
+                 char *out,
+                 size_t len) {
+  switch( algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE: {
+    uLongf n = len;
+    return uncompress((Bytef*) out, &n, in, in_len) == Z_OK &&
+      n == len ? 0 : -1;
+  }
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD: {
+    size_t n = ZSTD_decompress(out, len, in, in_len);
+    return !ZSTD_isError(n) && n == len ? 0 : -1;
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+//
+// Client
+//
+
+static
+int write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  ssize_t n;
+
+  while( len > 0 ) {
+    if( (n = write(fd, p, len)) <= 0 ) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Reads more bytes into the client's buffer. Returns -1 at EOF. */
+static
+int client_fill(client *c) {
+  unsigned char *buffer;
+  ssize_t n;
+
+  if( c->size - c->len < 65536 ) {
+    if( (buffer = realloc(c->buffer, c->size + 65536)) == NULL ) {
+      return -1;
+    }
+    c->buffer = buffer;
+    c->size += 65536;
+  }
+  if( (n = read(c->fd, c->buffer + c->len, c->size - c->len)) <= 0 ) {
+    return -1;
+  }
+  c->len += n;
+  return 0;
+}
+
+/* The next message: plain text up to a newline, with frames
+   expanded in place. Returns a new string, NULL on error. */
+static
+char* client_receive(client *c) {
+  char *text = NULL, *grown;
+  size_t text_len = 0, in_len, len, n;
+  unsigned char *eol;
+
+  for(;;) {
+    if( c->len > 0 && (c->buffer[0] == JRPC_COMPRESSION_DEFLATE ||
+                       c->buffer[0] == JRPC_COMPRESSION_ZSTD) ) {
+      if( c->len < FRAME_HEADER ||
+          c->len < FRAME_HEADER + get_uint32(c->buffer + 1) ) {
+        if( client_fill(c) != 0 ) {
+          break;
+        }
+        continue;
+      }
+      in_len = get_uint32(c->buffer + 1);
+      len = get_uint32(c->buffer + 5);
+      if( len > FRAME_TEXT_MAX ||
+          (grown = realloc(text, text_len + len + 1)) == NULL ) {
+        break;
+      }
+      text = grown;
+      if( expand_frame(c->buffer[0], c->buffer + FRAME_HEADER, in_len,
+                       text + text_len, len) != 0 ) {
+        break;
+      }
+      text_len += len;
+      n = FRAME_HEADER + in_len;
+      c->wire += n;
+    } else if( c->len > 0 ) {
+      /* Plain text, up to the next frame or newline */
+      for( n = 0; n < c->len && c->buffer[n] != '\n' &&
+             c->buffer[n] != JRPC_COMPRESSION_DEFLATE &&
+             c->buffer[n] != JRPC_COMPRESSION_ZSTD; n++ );
+      if( n < c->len && c->buffer[n] == '\n' ) {
+        n++;
+      }
+      if( (grown = realloc(text, text_len + n + 1)) == NULL ) {
+        break;
+      }
+      text = grown;
+      memcpy(text + text_len, c->buffer, n);
+      text_len += n;
+      c->wire += n;
+    } else {
+      if( client_fill(c) != 0 ) {
+        break;
+      }
+      continue;
+    }
+
+    c->len -= n;
+    memmove(c->buffer, c->buffer + n, c->len);
+    if( (eol = memchr(text, '\n', text_len)) != NULL ) {
+      /* One message per read here: nothing follows the newline */
+      c->text += text_len;
+      *eol = '\0';
+      return text;
+    }
+  }
+  free(text);
+  return NULL;
+}
+
+static
+json_t* client_call(client *c, const char *request, int algorithm) {
+  unsigned char *frame;
+  size_t len = strlen(request), size;
+  char *response;
+  json_t *json;
+
+  if( algorithm == 0 ) {
+    if( write_all(c->fd, request, len) != 0 ) {
+      return NULL;
+    }
+  } else {
+    if( (size = compress_frame(algorithm, request, len, &frame)) == 0 ) {
+      return NULL;
+    }
+    printf("  request:  %zu bytes sent as %zu\n", len, size);
+    if( write_all(c->fd, frame, size) != 0 ) {
+      free(frame);
+      return NULL;
+    }
+    free(frame);
+  }
+
+  c->wire = c->text = 0;
+  if( (response = client_receive(c)) == NULL ) {
+    return NULL;
+  }
+  if( algorithm != 0 ) {
+    printf("  response: %zu bytes received as %zu\n", c->text, c->wire);
+  }
+  json = json_loads(response, 0, NULL);
+  free(response);
+  return json;
+}
+
+/* Negotiates algorithm on a new connection and echoes a string of
+   size bytes through it. Returns 0 if it came back intact. */
+static
+int round_trip(int port, const char *name, int algorithm, size_t size) {
+  struct sockaddr_in addr;
+  client c;
+  json_t *request, *response;
+  char negotiate[128], *text, *value;
+  int result = -1;
+
+  printf("%s\n", name);
+  if( (client_algorithms & algorithm) == 0 ) {
+    printf("  not built in\n");
+    return 0;
+  }
+  memset(&c, 0, sizeof(c));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if( (c.fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+      connect(c.fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+    perror("connect");
+    return -1;
+  }
+
+  snprintf(negotiate, sizeof(negotiate),
+           "{\"jsonrpc\":\"2.0\",\"method\":\"rpc.compress\","
+           "\"params\":[\"%s\"],\"id\":1}\n", name);
+  response = client_call(&c, negotiate, 0);
+  if( response == NULL ||
+      !json_is_string(json_object_get(response, "result")) ) {
+    /* null: the server was built without it */
+    printf("  not available\n");
+    json_decref(response);
+    close(c.fd);
+    free(c.buffer);
+    return 0;
+  }
+  json_decref(response);
+
+  /* Repetitive, like most JSON */
+  value = malloc(size + 1);
+  for( size_t i = 0; i < size; i++ ) {
+    value[i] = "abcdefgh"[i % 8];
+  }
+  value[size] = '\0';
+  request = json_pack("{s:s,s:s,s:[s],s:i}", "jsonrpc", "2.0",
+                      "method", "echo", "params", value, "id", 2);
+  text = json_dumps(request, JSON_COMPACT);
+  json_decref(request);
+  text = realloc(text, strlen(text) + 2);
+  strcat(text, "\n");
+
+  response = client_call(&c, text, algorithm);
+  if( response != NULL &&
+      json_is_string(json_object_get(response, "result")) &&
+      strcmp(json_string_value(json_object_get(response, "result")),
+             value) == 0 ) {
+    printf("  round trip ok\n");
+    result = 0;
+  } else {
+    printf("  round trip failed\n");
+  }
+  json_decref(response);
+  free(text);
+  free(value);
+  free(c.buffer);
+  close(c.fd);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  int port = 1236, opt, failed = 0;
+  size_t size = 100000;
+  pid_t server;
+
+  while( (opt = getopt(argc, argv, "p:n:")) != -1 ) {
+    switch( opt ) {
+    case 'p': port = atoi(optarg); break;
+    case 'n': size = atol(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-p port] [-n size]\n", argv[0]);
+      return 2;
+    }
+  }
+  /* One frame carries the whole request */
+  if( size > FRAME_TEXT_MAX - 100 ) {
+    size = FRAME_TEXT_MAX - 100;
+  }
+
+  if( (server = fork()) == 0 ) {
+    return serve(port);
+  }
+  usleep(200000);
+
+  failed |= round_trip(port, "deflate", JRPC_COMPRESSION_DEFLATE, size);
+  failed |= round_trip(port, "zstd", JRPC_COMPRESSION_ZSTD, size);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  return failed ? 1 : 0;
+}
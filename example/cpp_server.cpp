@@ -0,0 +1,117 @@
+/*
+ * cpp_server.cpp
+ *
+ *  The C++ binding: procedures with ordinary signatures, served on
+ *  the same port as server.c.
+ *
+ *  cpp_server [-b count]
+ *
+ *  -b calls "add" count times in process, through the binding and
+ *  through a json_unpack handler, and prints the time per call.
+ */
+
+#include "jsonrpc-c.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#define PORT 1234
+
+jrpc_server my_server;
+
+static int add(int a, int b) {
+  return a + b;
+}
+
+static double scale(double value, double factor) {
+  return value * factor;
+}
+
+// Out of range for the parameter type is an invalid param too
+static bool is_even(unsigned char n) {
+  return n % 2 == 0;
+}
+
+static std::string say_hello(jrpc_context *ctx, const char *name) {
+  (void) ctx;
+  return std::string("Hello ") + name + "!";
+}
+
+// Exceptions are answered with JRPC_INTERNAL_ERROR and their what()
+static int divide(int a, int b) {
+  if( b == 0 ) {
+    throw std::domain_error("Division by zero");
+  }
+  return a / b;
+}
+
+// Any JSON value; the result reference is handed to the server
+static json_t* echo(json_t *value) {
+  return json_incref(value);
+}
+
+static const char* exit_server() {
+  jrpc_server_stop(&my_server);
+  return "Bye!";
+}
+
+// Hashed at compile time
+static constexpr jrpc::method add_method{"add"};
+
+//
+// Decoding benchmark
+//
+
+static json_t* add_unpack(jrpc_context *ctx, json_t *params, json_t *id) {
+  int a, b;
+  (void) id;
+  if( json_unpack(params, "[ii]", &a, &b) != 0 ) {
+    ctx->error_code = JRPC_INVALID_PARAMS;
+    ctx->error_msg = strdup("Invalid params");
+    return NULL;
+  }
+  return json_integer(a + b);
+}
+
+static double time_calls(jrpc_function function, json_t *params, long count) {
+  jrpc_context ctx;
+  auto start = std::chrono::steady_clock::now();
+
+  for( long i = 0; i < count; i++ ) {
+    memset(&ctx, 0, sizeof(ctx));
+    json_decref(function(&ctx, params, NULL));
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+    std::chrono::steady_clock::now() - start;
+  return elapsed.count() / count;
+}
+
+static int bench(long count) {
+  json_t *params = json_pack("[ii]", 20, 22);
+
+  printf("typed:       %.1f ns per call\n",
+         time_calls(&jrpc::procedure<add>, params, count));
+  printf("json_unpack: %.1f ns per call\n",
+         time_calls(add_unpack, params, count));
+  json_decref(params);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if( argc == 3 && strcmp(argv[1], "-b") == 0 ) {
+    return bench(atol(argv[2]));
+  }
+
+  jrpc_server_init(&my_server, "127.0.0.1", PORT);
+  jrpc::register_procedure<add>(&my_server, add_method);
+  jrpc::register_procedure<scale>(&my_server, "scale");
+  jrpc::register_procedure<is_even>(&my_server, "isEven");
+  jrpc::register_procedure<say_hello>(&my_server, "sayHello");
+  jrpc::register_procedure<divide>(&my_server, "divide");
+  jrpc::register_procedure<echo>(&my_server, "echo");
+  jrpc::register_procedure<exit_server>(&my_server, "exit");
+  jrpc_server_run(&my_server);
+  jrpc_server_destroy(&my_server);
+  return 0;
+}
@@ -27,19 +27,9 @@ jrpc_server my_server;
 
 json_t* say_hello(jrpc_context *ctx, json_t *params, json_t *id) {
   char buf[255];
-  json_t *param;
-  memset(&buf, 0, 255);
-  if( json_unpack(params, "[o]", &param) == 0 &&
-      json_string_value(param)!=NULL ) {
-    snprintf(buf, 254, "Hello %s!\n", json_string_value(param));
-    json_decref(param);
-  } else {
-#ifdef DEBUG
-    ctx->error_code=-1;
-    char *tmp=strdup("Missing name parameter!");
-    ctx->error_msg=tmp;
-#endif
-  }
+  /* params were checked against say_hello_params */
+  snprintf(buf, 254, "Hello %s!\n",
+           json_string_value(json_array_get(params, 0)));
   return json_string(buf);
 }
 
@@ -49,8 +39,13 @@ json_t* exit_server(jrpc_context *ctx, json_t *params, json_t *id) {
 }
 
 int main(void) {
+  json_t *say_hello_params = json_loads(
+    "{\"type\":\"array\",\"prefixItems\":[{\"type\":\"string\"}],"
+    "\"minItems\":1}", 0, NULL);
   jrpc_server_init(&my_server, "127.0.0.1", PORT);
-  jrpc_register_procedure(&my_server, say_hello, "sayHello", NULL );
+  jrpc_register_procedure_with_schema(&my_server, say_hello, "sayHello",
+                                      NULL, say_hello_params);
+  json_decref(say_hello_params);
   jrpc_register_procedure(&my_server, exit_server, "exit", NULL );
   jrpc_server_run(&my_server);
 #ifdef DEBUG
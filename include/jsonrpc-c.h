@@ -11,7 +11,7 @@
 #define _XOPEN_SOURCE_EXTENDED 700
 #define _GNU_SOURCE 1
 
-#ifndef JSONRCPC_H_
+#ifndef JSONRPCC_H_
 #define JSONRPCC_H_
 
 #include <stdio.h>
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -28,6 +29,10 @@
 #include <jansson.h>
 #include <ev.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * http://www.jsonrpc.org/specification
  *
@@ -49,6 +54,7 @@
 #define JRPC_METHOD_NOT_FOUND -32601
 #define JRPC_INVALID_PARAMS -32603
 #define JRPC_INTERNAL_ERROR -32693
+#define JRPC_DEADLINE_EXCEEDED -32001
 
 
 #define JRPC_SUCCESS 0
@@ -60,11 +66,42 @@
 
 #define FIELD_SIZE(type,field) (sizeof((((type*)0))->field))
 
+struct jrpc_connection;
+struct jrpc_output;
+struct jrpc_group;
+
+typedef struct jrpc_stream jrpc_stream;
+typedef struct jrpc_compress jrpc_compress;
+typedef struct jrpc_schema jrpc_schema;
+
+struct jrpc_cancel;
+
+typedef void
+(*jrpc_cancel_fn)(struct jrpc_cancel *token, void *data);
+
+// Cancellation token of the request being evaluated on a connection.
+// It fires once, when the request's deadline passes or the client
+// disconnects, and stays valid until the request completes
+// (including a streamed result).
+typedef struct jrpc_cancel {
+  int active;
+  int fired;
+  ev_tstamp deadline;     // 0: none
+  ev_tstamp probed;       // last check for a disconnected peer
+  jrpc_cancel_fn callback;
+  void *callback_data;
+  struct jrpc_connection *connection;
+} jrpc_cancel;
+
 typedef struct {
   void *data;
   int error_code;
   char *error_msg;
   json_t *error_data;
+
+  // connection the request arrived on, valid for the call
+  struct jrpc_connection *connection;
+  jrpc_cancel *cancel;
 } jrpc_context;
 
 typedef json_t*
@@ -72,10 +109,89 @@ typedef json_t*
 
 typedef struct{
   char * name;
+  uint32_t name_hash;
   jrpc_function function;
   void *data;
+  jrpc_schema *schema;    // compiled params schema, NULL: none
 } jrpc_procedure;
 
+// I/O backends. JRPC_BACKEND_URING falls back to JRPC_BACKEND_LIBEV
+// when io_uring is not compiled in or not permitted by the kernel;
+// jrpc_server.backend holds the one actually in use.
+typedef enum {
+  JRPC_BACKEND_LIBEV = 0,
+  JRPC_BACKEND_URING
+} jrpc_backend;
+
+// What happens to a notification queued on a connection whose
+// pending output already exceeds output_high_water bytes.
+// Responses are never affected.
+typedef enum {
+  JRPC_OVERFLOW_DISCONNECT = 0,  // close the slow connection
+  JRPC_OVERFLOW_DROP,            // drop the new notification
+  JRPC_OVERFLOW_COALESCE         // replace a queued, unsent notification
+                                 // of the same method, else drop
+} jrpc_overflow_policy;
+
+// Transport of a connection, detected from its first bytes
+typedef enum {
+  JRPC_PROTOCOL_UNKNOWN = 0,
+  JRPC_PROTOCOL_RAW,     // newline separated JSON
+  JRPC_PROTOCOL_HTTP,    // HTTP/1.1 POST, one request per message
+  JRPC_PROTOCOL_SHM      // newline separated JSON over shared memory
+} jrpc_protocol;
+
+// Tuning of the TCP listener; 0 keeps the system default. Socket
+// options are inherited by accepted connections.
+typedef struct {
+  int backlog;                  // accept queue length, 0: SOMAXCONN
+  int accept_budget;            // accepts per wakeup (libev), 0: 64
+  int nodelay;                  // TCP_NODELAY
+  int defer_accept;             // TCP_DEFER_ACCEPT: seconds to wait
+                                // for the first request bytes
+  int rcvbuf;                   // SO_RCVBUF, bytes
+  int sndbuf;                   // SO_SNDBUF, bytes
+  int fastopen;                 // TCP_FASTOPEN queue length
+} jrpc_listener_options;
+
+#define JRPC_ACCEPT_BUDGET 64
+
+// Seconds accepting stays paused after the process ran out of file
+// descriptors, unless a connection is closed sooner
+#define JRPC_ACCEPT_RETRY 0.5
+
+// Message compression a client may pick for its connection with the
+// "rpc.compress" method (raw TCP connections only)
+typedef enum {
+  JRPC_COMPRESSION_DEFLATE = 1,
+  JRPC_COMPRESSION_ZSTD = 2
+} jrpc_compression;
+
+#define JRPC_COMPRESS_THRESHOLD 1024
+
+#define JRPC_HTTP_MAX_BODY (8 * 1024 * 1024)
+
+typedef struct {
+  jrpc_backend backend;
+  size_t output_high_water;     // 0: unlimited
+  jrpc_overflow_policy overflow_policy;
+  int http;                     // also accept HTTP/1.1 POST requests
+  ev_tstamp request_timeout;    // seconds, 0: none
+  const char *shm_path;         // Unix socket for shared-memory clients
+  size_t shm_ring_size;         // bytes per direction, 0: 1 MiB
+  const char *handover_path;    // Unix socket for listener handover
+  ev_tstamp drain_timeout;      // seconds, 0: wait for every client
+  jrpc_listener_options listener;
+  int compression;              // jrpc_compression bits, 0: none
+  size_t compress_threshold;    // smallest message compressed, bytes,
+                                // 0: JRPC_COMPRESS_THRESHOLD
+  size_t http_max_body;         // largest HTTP request body, bytes,
+                                // 0: JRPC_HTTP_MAX_BODY
+  int keep_on_half_close;       // a client that stops sending may still
+                                // read: its EOF neither cancels the
+                                // request nor ends a streamed result
+} jrpc_server_options;
+
 #ifdef DEBUG
 typedef struct {
   int code;
@@ -88,28 +204,110 @@ typedef struct {
   int port_number;
   struct ev_loop *loop;
   struct ev_io listen_watcher;
+  jrpc_listener_options listener;
   int procedure_count;
   jrpc_procedure *procedures;
 
+  jrpc_backend backend;
+  void *uring;
+
+  size_t output_high_water;
+  jrpc_overflow_policy overflow_policy;
+  int http;
+  size_t http_max_body;
+  ev_tstamp request_timeout;
+  int keep_on_half_close;
+  struct jrpc_group *groups;
+
+  char *shm_path;
+  size_t shm_ring_size;
+  struct ev_io shm_watcher;
+
+  int compression;
+  size_t compress_threshold;
+
+  // accepting paused after EMFILE/ENFILE: 1 until accept_timer fires
+  // or a connection is freed, 2 while retrying
+  struct ev_timer accept_timer;
+  int accept_paused;
+
+  // listener handover and draining (jsonrpc-c-handover.c)
+  void *handover;
+  struct jrpc_connection *connections;
+
+  // connections with output queued during this loop iteration,
+  // flushed right before the loop blocks
+  struct ev_prepare flush_watcher;
+  struct jrpc_connection *dirty_head;
+  // keeps the loop from blocking while connections that became dirty
+  // again during the flush wait for the next iteration
+  struct ev_idle requeue_watcher;
+
 #ifdef DEBUG
   jrpc_error error;
 #endif
 
 } jrpc_server;
 
+// A connection to group membership, with the connection's index in
+// the group's member array
 typedef struct {
+  struct jrpc_group *group;
+  int index;
+} jrpc_membership;
+
+typedef struct jrpc_connection {
 
   struct ev_io io;
+  struct ev_io write_watcher;
 
   int fd;
   int pos;
   unsigned int buffer_size;
   char *buffer;
 
+  // pending output; out_offset bytes of the head are already sent
+  // and the first out_pinned entries are referenced by the kernel
+  struct jrpc_output *out_head, *out_tail;
+  size_t out_offset;
+  size_t out_bytes;
+  int out_pinned;
+  int dirty;
+  struct jrpc_connection *next_dirty;
+  int closing;
+  int half_closed;        // EOF read while a result streams, with
+                          // keep_on_half_close; closed at its end
+  // holds by running procedures and in-flight operations; a closing
+  // connection is freed once it has no holds and no queued output
+  int refs;
+
+  // transport state
+  jrpc_protocol protocol;
+  int responded;          // the current request queued a response
+  int http_keep_alive;
+  int http_minor;         // HTTP/1.x version of the current request
+  int http_continue;      // 100 Continue sent for the current request
+  jrpc_compress *compress; // negotiated compression, NULL: none
+
+  // result being streamed; input is not evaluated until it ends
+  jrpc_stream *stream;
+
+  // loop time of the last read, requests' deadlines count from it
+  ev_tstamp received;
+  jrpc_cancel cancel;
+  struct ev_timer deadline_timer;
+
+  jrpc_membership *groups;
+  int group_count;
+
   // server context
   jrpc_server *server;
+  struct jrpc_connection *prev, *next;
   int debug_level;
 
+  // backend private state (io_uring, shared memory)
+  void *backend_data;
+
 } jrpc_connection;
 
 //
@@ -117,74 +315,9 @@ typedef struct {
 //
 
 #ifdef DEBUG
-
-static
-char* jrpc_new_vsprintf(const char *fmt, va_list vargs);
-
-static
-char* jrpc_new_sprintf(const char *fmt, ...);
-
 void jrpc_clear_error(jrpc_server *server);
-
-static
-void jrpc_set_error(jrpc_server *server,
-                    int code,
-                    const char *cause,
-                    const char *msg);
-
 #endif
 
-static
-void* get_in_addr(struct sockaddr* sock);
-
-static
-int send_response(jrpc_connection* connection,
-                  char* response);
-
-static inline
-void send_static_error(jrpc_connection *conn);
-
-static
-int send_error(jrpc_connection *conn,
-               json_int_t code,
-               char *msg,
-               json_t *error_object,
-               json_t *id);
-
-static
-int send_result(jrpc_connection *conn,
-                json_t *result_object,
-                json_t *id);
-
-static
-int invoke_procedure(jrpc_server *server,
-                     jrpc_connection *conn,
-                     const char *name,
-                     json_t *params,
-                     json_t *id);
-
-static
-int eval_request(jrpc_server* server,
-                 jrpc_connection* conn,
-                 json_t* root);
-
-static
-void close_connection(struct ev_loop *loop,
-                      struct ev_io *w);
-
-static
-void handle_buffer(jrpc_connection *conn);
-
-static
-void connection_cb(struct ev_loop *loop,
-                   struct ev_io *w,
-                   int revents);
-
-static
-void accept_cb(struct ev_loop *loop,
-               struct ev_io *w,
-               int revents);
-
 int jrpc_server_init(jrpc_server *server,
                      const char *hostname,
                      int port);
@@ -194,8 +327,11 @@ int jrpc_server_init_with_ev_loop(jrpc_server *server,
                                   int port,
                                   struct ev_loop *loop);
 
-static
-int __jrpc_server_start(jrpc_server *server);
+int jrpc_server_init_with_options(jrpc_server *server,
+                                  const char *hostname,
+                                  int port,
+                                  struct ev_loop *loop,
+                                  const jrpc_server_options *options);
 
 void jrpc_server_run(jrpc_server *server);
 
@@ -203,15 +339,171 @@ int jrpc_server_stop(jrpc_server *server);
 
 void jrpc_server_destroy(jrpc_server *server);
 
-static
-void jrpc_procedure_destroy(jrpc_procedure *procedure);
-
 int jrpc_register_procedure(jrpc_server *server,
                             jrpc_function function_pointer,
                             char *name,
                             void *data);
 
+// Same, with name's jrpc_name_hash() computed by the caller, e.g. at
+// compile time by the C++ binding. name_hash must match name.
+int jrpc_register_procedure_hashed(jrpc_server *server,
+                                   jrpc_function function_pointer,
+                                   char *name,
+                                   uint32_t name_hash,
+                                   void *data);
+
+// Requests whose params do not match schema are answered with
+// JRPC_INVALID_PARAMS, and the path of the mismatch as error data,
+// without calling the procedure. schema is a subset of JSON Schema
+// (see README), compiled here; it is not stolen, and NULL checks
+// nothing. Returns -1 if schema uses an unsupported keyword.
+int jrpc_register_procedure_with_schema(jrpc_server *server,
+                                        jrpc_function function_pointer,
+                                        char *name,
+                                        void *data,
+                                        json_t *schema);
+
 int jrpc_deregister_procedure(jrpc_server *server,
                               char *name);
 
+//
+// Notifications
+//
+// A connection stays valid until it is closed; keep it in a group
+// rather than holding the pointer, closed connections leave their
+// groups automatically. params is not stolen.
+//
+
+int jrpc_notify(struct jrpc_connection *conn,
+                const char *method,
+                json_t *params);
+
+int jrpc_group_join(struct jrpc_connection *conn,
+                    const char *group);
+
+int jrpc_group_leave(struct jrpc_connection *conn,
+                     const char *group);
+
+// Serializes the notification once and queues the same buffer on
+// every member. Returns the number of members it was queued on.
+int jrpc_broadcast(jrpc_server *server,
+                   const char *group,
+                   const char *method,
+                   json_t *params);
+
+//
+// Streamed results
+//
+// A procedure that begins a stream returns NULL; its result is then
+// written by produce, which is called whenever the connection's
+// pending output is below the high-water mark (output_high_water,
+// or JRPC_STREAM_HIGH_WATER when unlimited), until it returns 1 (the
+// result is complete) or -1 (abort, the connection is closed). Each
+// call must write something or finish. If the connection closes
+// first, produce is called once more with every write failing.
+// Further requests on the connection wait for the stream to end, and
+// notifications to it are refused meanwhile.
+//
+
+#define JRPC_STREAM_HIGH_WATER (256 * 1024)
+
+typedef int
+(*jrpc_stream_fn)(jrpc_stream *stream, void *data);
+
+// Returns NULL for notifications (id is NULL) and on error
+jrpc_stream* jrpc_stream_begin(jrpc_context *ctx,
+                               json_t *id,
+                               jrpc_stream_fn produce,
+                               void *data);
+
+// Appends an element to the result array; element is not stolen.
+// Returns 1 once the high-water mark is reached and produce should
+// return, 0 if there is room for more, -1 if the connection is gone.
+int jrpc_stream_write(jrpc_stream *stream,
+                      json_t *element);
+
+// Appends serialized JSON text instead; the raw writes of a stream
+// together form its result. Same return values.
+int jrpc_stream_write_raw(jrpc_stream *stream,
+                          const char *data,
+                          size_t len);
+
+//
+// Deadlines and cancellation
+//
+// A request's deadline is the smaller of the server's
+// request_timeout and the request's own "timeout" member (seconds),
+// counted from its arrival. Requests that expire before they are
+// dispatched are answered with JRPC_DEADLINE_EXCEEDED, as are
+// procedures that return after their deadline.
+//
+
+// Nonzero once the token fired. Also checks the deadline and whether
+// the client hung up, so long running procedures can poll it. An EOF
+// counts as hanging up; with keep_on_half_close only a reset or a
+// fully shut down socket does, as the client may have shut down just
+// its sending side and still read the response.
+int jrpc_cancel_poll(jrpc_cancel *token);
+
+// Calls fn when the token fires, right away if it already did.
+// Replaces a previously registered callback.
+void jrpc_cancel_register(jrpc_cancel *token,
+                          jrpc_cancel_fn fn,
+                          void *data);
+
+//
+// Listener handover
+//
+// A server started with handover_path takes over the listening
+// sockets of the process serving on that path, if any, instead of
+// binding them, and then serves the path itself. The old process
+// stops accepting once the new one is ready, closes its connections
+// as they go idle (or after drain_timeout) and then stops its loop,
+// so jrpc_server_run returns and the process can exit. Clients see
+// no refused connections. The socket is created mode 0600, and only
+// processes of the server's effective user may take over.
+//
+
+// Returns 1 while the server drains after a handover
+int jrpc_server_draining(jrpc_server *server);
+
+//
+// Shared-memory transport
+//
+// Same-host clients connect to the server's shm_path and receive a
+// memfd holding two single-producer/single-consumer rings, one per
+// direction, plus an eventfd to wake each side. The rings carry the
+// same newline separated JSON as TCP connections, so procedures need
+// no changes. Both sides spin briefly before sleeping on their
+// eventfd, adapting the spin to how quickly the peer answers.
+//
+
+typedef struct jrpc_shm_client jrpc_shm_client;
+
+jrpc_shm_client* jrpc_shm_connect(const char *path);
+
+void jrpc_shm_disconnect(jrpc_shm_client *client);
+
+// Queues one request, waiting for room in the ring if needed
+int jrpc_shm_send(jrpc_shm_client *client,
+                  const char *request,
+                  size_t len);
+
+// Waits for the next message from the server (a response or a
+// notification). Returns a string to free(), NULL once the server
+// is gone.
+char* jrpc_shm_receive(jrpc_shm_client *client);
+
+char* jrpc_shm_call(jrpc_shm_client *client,
+                    const char *request,
+                    size_t len);
+
+// 32-bit FNV-1a hash used to look up procedure names. The C++
+// binding (jsonrpc-c.hpp) mirrors it as a constexpr function.
+uint32_t jrpc_name_hash(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,334 @@
+/*
+ * jsonrpc-c.hpp
+ *
+ *  Header-only C++17 binding over jrpc_register_procedure.
+ *
+ *  Parameter decoding and result encoding are derived from an
+ *  ordinary function signature at compile time:
+ *
+ *    static int add(int a, int b) { return a + b; }
+ *    static std::string hello(jrpc_context *ctx, const char *name);
+ *
+ *    jrpc::register_procedure<add>(&server, "add");
+ *    jrpc::register_procedure<hello>(&server, "sayHello");
+ *
+ *  example/cpp_server.cpp shows the supported types.
+ *
+ *  Positional params (a JSON array) are matched against the argument
+ *  list; a mismatch in arity or type answers JRPC_INVALID_PARAMS
+ *  without calling the function. An optional leading jrpc_context*
+ *  gives access to ctx->data and to custom error reporting.
+ */
+
+#ifndef JSONRPCC_HPP_
+#define JSONRPCC_HPP_
+
+// Comes first: it sets the feature test macros
+#include "jsonrpc-c.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace jrpc {
+
+//
+// Method names
+//
+
+// Same FNV-1a hash as jrpc_name_hash(), usable in constant
+// expressions (e.g. case labels of a dispatching handler).
+constexpr uint32_t name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  while( *name ) {
+    hash ^= static_cast<unsigned char>(*name++);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// A method name and its hash. Declared constexpr, the hash is
+// computed at compile time and registration skips hashing:
+//
+//   static constexpr jrpc::method add_method{"add"};
+//   jrpc::register_procedure<add>(&server, add_method);
+struct method {
+  const char *name;
+  uint32_t hash;
+
+  constexpr method(const char *name) : name(name), hash(name_hash(name)) {}
+};
+
+namespace detail {
+
+template<typename T>
+struct always_false : std::false_type {};
+
+//
+// Parameter decoding
+//
+
+template<typename T, typename Enable = void>
+struct param {
+  static_assert(always_false<T>::value,
+                "jrpc: unsupported parameter type");
+};
+
+template<>
+struct param<bool> {
+  static constexpr const char *name = "boolean";
+  static bool decode(json_t *json, bool &out) {
+    if( !json_is_boolean(json) ) return false;
+    out = json_is_true(json);
+    return true;
+  }
+};
+
+template<typename T>
+struct param<T, std::enable_if_t<std::is_integral_v<T> &&
+                                 !std::is_same_v<T, bool>>> {
+  static constexpr const char *name = "integer";
+  static bool decode(json_t *json, T &out) {
+    if( !json_is_integer(json) ) return false;
+    json_int_t value = json_integer_value(json);
+    if constexpr (std::is_unsigned_v<T>) {
+      if( value < 0 ||
+          static_cast<unsigned long long>(value) >
+          std::numeric_limits<T>::max() ) return false;
+    } else {
+      if( value < std::numeric_limits<T>::min() ||
+          value > std::numeric_limits<T>::max() ) return false;
+    }
+    out = static_cast<T>(value);
+    return true;
+  }
+};
+
+template<typename T>
+struct param<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static constexpr const char *name = "number";
+  static bool decode(json_t *json, T &out) {
+    if( !json_is_number(json) ) return false;
+    out = static_cast<T>(json_number_value(json));
+    return true;
+  }
+};
+
+// Borrowed from params, valid for the duration of the call.
+template<>
+struct param<const char*> {
+  static constexpr const char *name = "string";
+  static bool decode(json_t *json, const char *&out) {
+    if( !json_is_string(json) ) return false;
+    out = json_string_value(json);
+    return true;
+  }
+};
+
+template<>
+struct param<std::string> {
+  static constexpr const char *name = "string";
+  static bool decode(json_t *json, std::string &out) {
+    if( !json_is_string(json) ) return false;
+    out.assign(json_string_value(json), json_string_length(json));
+    return true;
+  }
+};
+
+// Any JSON value, borrowed from params.
+template<>
+struct param<json_t*> {
+  static constexpr const char *name = "value";
+  static bool decode(json_t *json, json_t *&out) {
+    out = json;
+    return true;
+  }
+};
+
+//
+// Result encoding
+//
+
+template<typename T, typename Enable = void>
+struct result {
+  static_assert(always_false<T>::value,
+                "jrpc: unsupported result type");
+};
+
+template<>
+struct result<bool> {
+  static json_t* encode(bool value) { return json_boolean(value); }
+};
+
+template<typename T>
+struct result<T, std::enable_if_t<std::is_integral_v<T> &&
+                                  !std::is_same_v<T, bool>>> {
+  static json_t* encode(T value) {
+    return json_integer(static_cast<json_int_t>(value));
+  }
+};
+
+template<typename T>
+struct result<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static json_t* encode(T value) {
+    return json_real(static_cast<double>(value));
+  }
+};
+
+template<>
+struct result<const char*> {
+  static json_t* encode(const char *value) {
+    return value != nullptr ? json_string(value) : json_null();
+  }
+};
+
+template<>
+struct result<std::string> {
+  static json_t* encode(const std::string &value) {
+    return json_stringn(value.data(), value.size());
+  }
+};
+
+// Ownership of the reference passes to the server, as with a
+// plain jrpc_function.
+template<>
+struct result<json_t*> {
+  static json_t* encode(json_t *value) { return value; }
+};
+
+//
+// Signature introspection
+//
+
+template<typename F>
+struct signature;
+
+template<typename R, typename... Args>
+struct signature<R (*)(Args...)> {
+  using return_type = R;
+  using args = std::tuple<std::decay_t<Args>...>;
+  static constexpr bool wants_context = false;
+};
+
+template<typename R, typename... Args>
+struct signature<R (*)(jrpc_context*, Args...)> {
+  using return_type = R;
+  using args = std::tuple<std::decay_t<Args>...>;
+  static constexpr bool wants_context = true;
+};
+
+template<typename R, typename... Args>
+struct signature<R (*)(Args...) noexcept> : signature<R (*)(Args...)> {};
+
+template<typename R, typename... Args>
+struct signature<R (*)(jrpc_context*, Args...) noexcept>
+  : signature<R (*)(jrpc_context*, Args...)> {};
+
+inline void set_error(jrpc_context *ctx, int code, const char *msg) {
+  ctx->error_code = code;
+  if( ctx->error_msg == nullptr ) {
+    ctx->error_msg = strdup(msg);
+  }
+}
+
+template<typename Args, std::size_t... I>
+bool decode_params(jrpc_context *ctx, json_t *params, Args &args,
+                   std::index_sequence<I...>) {
+  constexpr std::size_t arity = sizeof...(I);
+  std::size_t given = json_is_array(params) ? json_array_size(params) : 0;
+
+  if( (params != nullptr && !json_is_array(params) && !json_is_null(params))
+      || given != arity ) {
+    char msg[80];
+    snprintf(msg, sizeof(msg), "Invalid params: expected %zu argument(s)",
+             arity);
+    set_error(ctx, JRPC_INVALID_PARAMS, msg);
+    return false;
+  }
+
+  std::size_t failed = arity;
+  const char *expected = nullptr;
+  // Stops at the first argument that fails to decode
+  (void)((param<std::tuple_element_t<I, Args>>::decode(
+            json_array_get(params, I), std::get<I>(args)) ||
+          (failed = I,
+           expected = param<std::tuple_element_t<I, Args>>::name,
+           false)) && ...);
+
+  if( failed != arity ) {
+    char msg[80];
+    snprintf(msg, sizeof(msg), "Invalid params: expected %s at index %zu",
+             expected, failed);
+    set_error(ctx, JRPC_INVALID_PARAMS, msg);
+    return false;
+  }
+  return true;
+}
+
+template<auto F, typename Args, std::size_t... I>
+decltype(auto) call(jrpc_context *ctx, Args &args,
+                    std::index_sequence<I...>) {
+  if constexpr (signature<decltype(F)>::wants_context) {
+    return F(ctx, std::get<I>(std::move(args))...);
+  } else {
+    (void) ctx;
+    return F(std::get<I>(std::move(args))...);
+  }
+}
+
+} // namespace detail
+
+//
+// Binding
+//
+
+// A plain jrpc_function wrapping F. Exceptions thrown by F are
+// reported as JRPC_INTERNAL_ERROR and never cross into the C library.
+template<auto F>
+json_t* procedure(jrpc_context *ctx, json_t *params, json_t *id) {
+  using sig = detail::signature<decltype(F)>;
+  using args_t = typename sig::args;
+  using ret_t = std::decay_t<typename sig::return_type>;
+  constexpr auto indices =
+    std::make_index_sequence<std::tuple_size_v<args_t>>{};
+  (void) id;
+
+  args_t args{};
+  if( !detail::decode_params(ctx, params, args, indices) ) {
+    return nullptr;
+  }
+
+  try {
+    if constexpr (std::is_void_v<ret_t>) {
+      detail::call<F>(ctx, args, indices);
+      return nullptr;
+    } else {
+      return detail::result<ret_t>::encode(
+               detail::call<F>(ctx, args, indices));
+    }
+  } catch( const std::exception &e ) {
+    detail::set_error(ctx, JRPC_INTERNAL_ERROR, e.what());
+  } catch( ... ) {
+    detail::set_error(ctx, JRPC_INTERNAL_ERROR, "Internal error");
+  }
+  return nullptr;
+}
+
+template<auto F>
+int register_procedure(jrpc_server *server,
+                       const method &name,
+                       void *data = nullptr) {
+  return jrpc_register_procedure_hashed(server, &procedure<F>,
+                                        const_cast<char*>(name.name),
+                                        name.hash, data);
+}
+
+} // namespace jrpc
+
+#endif
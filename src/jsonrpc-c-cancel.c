@@ -0,0 +1,121 @@
+/*
+ * jsonrpc-c-cancel.c
+ *
+ *  Request deadlines and cancellation tokens.
+ *
+ *  A connection evaluates one request at a time, so each connection
+ *  owns a single token that is re-armed for every request. While a
+ *  procedure runs the loop does not, so expiry and disconnects are
+ *  only noticed when the procedure polls; a streamed result that
+ *  outlives the call has its deadline watched by a timer.
+ */
+
+#include "jsonrpc-c-internal.h"
+
+#include <poll.h>
+
+// minimum interval between checks for a disconnected peer
+#define CANCEL_PROBE_INTERVAL 0.01
+
+static
+void deadline_cb(struct ev_loop *loop,
+                 struct ev_timer *w,
+                 int revents) {
+  jrpc_connection *conn = (jrpc_connection*) w->data;
+  jrpc_cancel_fire(&conn->cancel);
+}
+
+/* After an EOF: whether the client gave up. With keep_on_half_close
+   it may have shut down only its sending side and still be reading,
+   which a reset or a fully shut down socket rules out. */
+static
+int peer_gone(jrpc_connection *conn) {
+  struct pollfd pfd = { conn->fd, POLLOUT, 0 };
+
+  if( !conn->server->keep_on_half_close ) {
+    return 1;
+  }
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+void jrpc_cancel_init(jrpc_connection *conn) {
+  conn->cancel.connection = conn;
+  ev_timer_init(&conn->deadline_timer, deadline_cb, 0., 0.);
+  conn->deadline_timer.data = conn;
+}
+
+void jrpc_cancel_arm(jrpc_connection *conn, ev_tstamp deadline) {
+  jrpc_cancel *token = &conn->cancel;
+  token->active = 1;
+  token->fired = 0;
+  token->deadline = deadline;
+  token->probed = 0;
+  token->callback = NULL;
+  token->callback_data = NULL;
+}
+
+void jrpc_cancel_watch(jrpc_connection *conn) {
+  jrpc_cancel *token = &conn->cancel;
+  struct ev_loop *loop = conn->server->loop;
+
+  if( token->deadline > 0 && !token->fired ) {
+    ev_timer_set(&conn->deadline_timer,
+                 token->deadline - ev_now(loop), 0.);
+    ev_timer_start(loop, &conn->deadline_timer);
+  }
+}
+
+void jrpc_cancel_disarm(jrpc_connection *conn) {
+  conn->cancel.active = 0;
+  conn->cancel.callback = NULL;
+  ev_timer_stop(conn->server->loop, &conn->deadline_timer);
+}
+
+void jrpc_cancel_fire(jrpc_cancel *token) {
+  if( !token->active || token->fired ) {
+    return;
+  }
+  token->fired = 1;
+  if( token->callback != NULL ) {
+    token->callback(token, token->callback_data);
+  }
+}
+
+int jrpc_cancel_expired(jrpc_cancel *token) {
+  return token->deadline > 0 && ev_time() >= token->deadline;
+}
+
+int jrpc_cancel_poll(jrpc_cancel *token) {
+  jrpc_connection *conn = token->connection;
+  ev_tstamp now;
+  ssize_t peeked;
+  char c;
+
+  if( token->fired || !token->active ) {
+    return token->fired;
+  }
+  now = ev_time();
+  if( conn->closing || (token->deadline > 0 && now >= token->deadline) ) {
+    jrpc_cancel_fire(token);
+  } else if( now - token->probed >= CANCEL_PROBE_INTERVAL ) {
+    /* A reset on the socket means the client gave up */
+    token->probed = now;
+    peeked = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if( (peeked == 0 && peer_gone(conn)) ||
+        (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+         errno != EINTR) ) {
+      jrpc_cancel_fire(token);
+    }
+  }
+  return token->fired;
+}
+
+void jrpc_cancel_register(jrpc_cancel *token,
+                          jrpc_cancel_fn fn,
+                          void *data) {
+  token->callback = fn;
+  token->callback_data = data;
+  if( token->fired && fn != NULL ) {
+    fn(token, data);
+  }
+}
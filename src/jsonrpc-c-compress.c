@@ -0,0 +1,474 @@
+/*
+ * jsonrpc-c-compress.c
+ *
+ *  Message compression on raw TCP connections.
+ *
+ *  A client asks for it with
+ *
+ *    {"jsonrpc":"2.0","method":"rpc.compress","params":["zstd","deflate"],"id":1}
+ *
+ *  and the server answers with the first of those algorithms it
+ *  allows, or null; HTTP and shared-memory connections get an error.
+ *  Once the client has read that response, any part of the newline
+ *  separated text may travel as a frame instead, in both directions:
+ *
+ *    algorithm        1 byte, 1: deflate (zlib format), 2: zstd
+ *    compressed size  4 bytes, big endian
+ *    text size        4 bytes, big endian, at most 1 MiB
+ *    compressed text
+ *
+ *  Neither algorithm byte occurs in JSON text, so frames and plain
+ *  text mix freely. Every frame is compressed on its own, which keeps
+ *  queued notifications droppable and replaceable, but the
+ *  compression contexts are kept for the life of the connection.
+ *  Messages shorter than compress_threshold, or that would not
+ *  shrink, are sent as they are.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "jsonrpc-c-internal.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define COMPRESS_DEFLATE 1
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define COMPRESS_ZSTD 1
+#include <zstd.h>
+#ifndef ZSTD_CLEVEL_DEFAULT
+#define ZSTD_CLEVEL_DEFAULT 3
+#endif
+#endif
+
+#define FRAME_HEADER 9
+// text per frame, longer messages take several
+#define FRAME_TEXT_MAX (1024 * 1024)
+
+struct jrpc_compress {
+  jrpc_compression algorithm;   // of the frames we send
+  int active;                   // 0 until the negotiation is answered
+
+#ifdef COMPRESS_DEFLATE
+  z_stream deflate;
+  z_stream inflate;
+  int deflate_ready;
+  int inflate_ready;
+#endif
+#ifdef COMPRESS_ZSTD
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+#endif
+
+  // frame being received
+  unsigned char header[FRAME_HEADER];
+  size_t header_len;
+  char *frame;
+  size_t frame_len;
+  size_t frame_size;
+};
+
+static const struct {
+  const char *name;
+  jrpc_compression algorithm;
+} algorithms[] = {
+  { "deflate", JRPC_COMPRESSION_DEFLATE },
+  { "zstd", JRPC_COMPRESSION_ZSTD }
+};
+
+static
+jrpc_compression algorithm_named(const char *name) {
+  size_t i;
+
+  for( i = 0; name != NULL && i < sizeof(algorithms) / sizeof(*algorithms);
+       i++ ) {
+    if( strcmp(algorithms[i].name, name) == 0 ) {
+      return algorithms[i].algorithm;
+    }
+  }
+  return 0;
+}
+
+static
+void put_uint32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static
+uint32_t get_uint32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+    (uint32_t) p[2] << 8 | p[3];
+}
+
+//
+// Algorithms
+//
+
+/* Creates the context for sending with algorithm. Returns -1 if it
+   is not compiled in. */
+static
+int compressor_init(jrpc_compress *c, jrpc_compression algorithm) {
+  switch( algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE:
+    if( !c->deflate_ready ) {
+      if( deflateInit(&c->deflate, Z_DEFAULT_COMPRESSION) != Z_OK ) {
+        return -1;
+      }
+      c->deflate_ready = 1;
+    }
+    return 0;
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD:
+    if( c->cctx == NULL && (c->cctx = ZSTD_createCCtx()) == NULL ) {
+      return -1;
+    }
+    return 0;
+#endif
+  default:
+    return -1;
+  }
+}
+
+/* Largest compressed size of len bytes of text */
+static
+size_t compress_bound(jrpc_compress *c,
+                      jrpc_compression algorithm,
+                      size_t len) {
+  switch( algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE:
+    return c != NULL ? deflateBound(&c->deflate, len) : compressBound(len);
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD:
+    return ZSTD_compressBound(len);
+#endif
+  default:
+    return 0;
+  }
+}
+
+/* Returns the compressed size, 0 on error */
+static
+size_t compress_text(jrpc_compress *c,
+                     const char *text,
+                     size_t len,
+                     char *out,
+                     size_t size) {
+  size_t result;
+
+  switch( c->algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE:
+    deflateReset(&c->deflate);
+    c->deflate.next_in = (Bytef*) text;
+    c->deflate.avail_in = len;
+    c->deflate.next_out = (Bytef*) out;
+    c->deflate.avail_out = size;
+    if( deflate(&c->deflate, Z_FINISH) != Z_STREAM_END ) {
+      return 0;
+    }
+    return size - c->deflate.avail_out;
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD:
+    result = ZSTD_compressCCtx(c->cctx, out, size, text, len,
+                               ZSTD_CLEVEL_DEFAULT);
+    return ZSTD_isError(result) ? 0 : result;
+#endif
+  default:
+    (void) result;
+    return 0;
+  }
+}
+
+/* Expands a frame into exactly len bytes of text. Returns 0 on
+   success. */
+static
+int expand_text(jrpc_compress *c,
+                jrpc_compression algorithm,
+                const char *in,
+                size_t in_len,
+                char *out,
+                size_t len) {
+  size_t result;
+
+  switch( algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE:
+    if( c->inflate_ready ) {
+      inflateReset(&c->inflate);
+    } else if( inflateInit(&c->inflate) == Z_OK ) {
+      c->inflate_ready = 1;
+    } else {
+      return -1;
+    }
+    c->inflate.next_in = (Bytef*) in;
+    c->inflate.avail_in = in_len;
+    c->inflate.next_out = (Bytef*) out;
+    c->inflate.avail_out = len;
+    if( inflate(&c->inflate, Z_FINISH) != Z_STREAM_END ||
+        c->inflate.avail_in != 0 || c->inflate.avail_out != 0 ) {
+      return -1;
+    }
+    return 0;
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD:
+    if( c->dctx == NULL && (c->dctx = ZSTD_createDCtx()) == NULL ) {
+      return -1;
+    }
+    result = ZSTD_decompressDCtx(c->dctx, out, len, in, in_len);
+    return !ZSTD_isError(result) && result == len ? 0 : -1;
+#endif
+  default:
+    (void) result;
+    return -1;
+  }
+}
+
+//
+// Negotiation
+//
+
+json_t* jrpc_compress_negotiate(jrpc_context *ctx,
+                                json_t *params,
+                                json_t *id) {
+  jrpc_connection *conn = ctx->connection;
+  jrpc_compression algorithm;
+  jrpc_compress *c;
+  json_t *name;
+  size_t i;
+
+  if( !json_is_array(params) ) {
+    ctx->error_code = JRPC_INVALID_PARAMS;
+    ctx->error_msg = strdup("Expected a list of algorithm names");
+    return NULL;
+  }
+  /* HTTP has Content-Encoding, and shared memory nothing to gain */
+  if( conn->protocol != JRPC_PROTOCOL_RAW ) {
+    ctx->error_code = JRPC_INVALID_REQUEST;
+    ctx->error_msg = strdup("Compression is only available on raw TCP "
+                            "connections");
+    return NULL;
+  }
+  json_array_foreach(params, i, name) {
+    algorithm = algorithm_named(json_string_value(name));
+    if( (conn->server->compression & algorithm) == 0 ) {
+      continue;
+    }
+    if( (c = conn->compress) == NULL &&
+        (c = calloc(1, sizeof(jrpc_compress))) == NULL ) {
+      return NULL;
+    }
+    conn->compress = c;
+    if( compressor_init(c, algorithm) == 0 ) {
+      c->algorithm = algorithm;
+      /* This response still goes out as it is */
+      c->active = 0;
+      return json_string(json_string_value(name));
+    }
+  }
+  if( conn->compress != NULL && conn->compress->algorithm == 0 ) {
+    jrpc_compress_free(conn);
+  }
+  return json_null();
+}
+
+//
+// Output
+//
+
+jrpc_buffer* jrpc_compress_buffer(jrpc_connection *conn,
+                                  jrpc_buffer *buf,
+                                  jrpc_buffer **frames_cache) {
+  jrpc_compress *c = conn->compress;
+  jrpc_buffer *frames, *shrunk;
+  size_t size = 0, offset, n, len;
+  unsigned char *out;
+
+  if( !c->active || buf->len < conn->server->compress_threshold ) {
+    c->active = 1;
+    buf->refcount++;
+    return buf;
+  }
+  if( frames_cache != NULL && frames_cache[c->algorithm] != NULL ) {
+    frames_cache[c->algorithm]->refcount++;
+    return frames_cache[c->algorithm];
+  }
+
+  for( offset = 0; offset < buf->len; offset += FRAME_TEXT_MAX ) {
+    n = buf->len - offset < FRAME_TEXT_MAX ? buf->len - offset
+                                           : FRAME_TEXT_MAX;
+    size += FRAME_HEADER + compress_bound(c, c->algorithm, n);
+  }
+  if( (frames = jrpc_buffer_new(NULL, size)) == NULL ) {
+    return NULL;
+  }
+  frames->len = 0;
+  for( offset = 0; offset < buf->len; offset += n ) {
+    n = buf->len - offset < FRAME_TEXT_MAX ? buf->len - offset
+                                           : FRAME_TEXT_MAX;
+    out = (unsigned char*) frames->data + frames->len;
+    len = compress_text(c, buf->data + offset, n,
+                        (char*) out + FRAME_HEADER,
+                        size - frames->len - FRAME_HEADER);
+    if( len == 0 ) {
+      jrpc_buffer_unref(frames);
+      return NULL;
+    }
+    out[0] = c->algorithm;
+    put_uint32(out + 1, len);
+    put_uint32(out + 5, n);
+    frames->len += FRAME_HEADER + len;
+  }
+
+  if( frames->len >= buf->len ) {
+    /* Incompressible */
+    jrpc_buffer_unref(frames);
+    frames = buf;
+    frames->refcount++;
+  } else if( (shrunk = realloc(frames, sizeof(jrpc_buffer) +
+                               frames->len)) != NULL ) {
+    frames = shrunk;
+  }
+  if( frames_cache != NULL ) {
+    frames_cache[c->algorithm] = frames;
+    frames->refcount++;
+  }
+  return frames;
+}
+
+//
+// Input
+//
+
+/* Validates the header of the frame being received and makes room
+   for its payload */
+static
+int frame_begin(jrpc_compress *c) {
+  uint32_t in_len = get_uint32(c->header + 1);
+  uint32_t len = get_uint32(c->header + 5);
+  char *frame;
+
+  if( len == 0 || len > FRAME_TEXT_MAX || in_len == 0 ||
+      in_len > compress_bound(NULL, c->header[0], len) ) {
+    return -1;
+  }
+  if( in_len > c->frame_size ) {
+    if( (frame = realloc(c->frame, in_len)) == NULL ) {
+      return -1;
+    }
+    c->frame = frame;
+    c->frame_size = in_len;
+  }
+  c->frame_len = 0;
+  return 0;
+}
+
+/* Expands a complete frame onto the input buffer */
+static
+int frame_end(jrpc_connection *conn, const char *in) {
+  jrpc_compress *c = conn->compress;
+  size_t len = get_uint32(c->header + 5);
+  char *text;
+
+  c->header_len = 0;
+  if( (text = jrpc_connection_reserve(conn, len)) == NULL ||
+      expand_text(c, c->header[0], in, get_uint32(c->header + 1),
+                  text, len) != 0 ) {
+    return -1;
+  }
+  conn->pos += len;
+  return 0;
+}
+
+int jrpc_compress_feed(jrpc_connection *conn,
+                       const char *data,
+                       size_t len) {
+  jrpc_compress *c = conn->compress;
+  const char *end = data + len, *p;
+  size_t n, in_len;
+  char *text;
+
+  while( data < end ) {
+    if( c->header_len == 0 ) {
+      /* Plain text up to the next frame */
+      for( p = data; p < end && *p != JRPC_COMPRESSION_DEFLATE &&
+             *p != JRPC_COMPRESSION_ZSTD; p++ );
+      if( p > data ) {
+        if( (text = jrpc_connection_reserve(conn, p - data)) == NULL ) {
+          return -1;
+        }
+        memcpy(text, data, p - data);
+        conn->pos += p - data;
+        data = p;
+        continue;
+      }
+    }
+
+    if( c->header_len < FRAME_HEADER ) {
+      n = FRAME_HEADER - c->header_len;
+      n = (size_t) (end - data) < n ? (size_t) (end - data) : n;
+      memcpy(c->header + c->header_len, data, n);
+      c->header_len += n;
+      data += n;
+      if( c->header_len < FRAME_HEADER ) {
+        break;
+      }
+      if( frame_begin(c) != 0 ) {
+        return -1;
+      }
+    }
+
+    in_len = get_uint32(c->header + 1);
+    if( c->frame_len == 0 && (size_t) (end - data) >= in_len ) {
+      /* The whole frame is at hand, no need to collect it */
+      if( frame_end(conn, data) != 0 ) {
+        return -1;
+      }
+      data += in_len;
+      continue;
+    }
+    n = in_len - c->frame_len;
+    n = (size_t) (end - data) < n ? (size_t) (end - data) : n;
+    memcpy(c->frame + c->frame_len, data, n);
+    c->frame_len += n;
+    data += n;
+    if( c->frame_len == in_len && frame_end(conn, c->frame) != 0 ) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void jrpc_compress_free(jrpc_connection *conn) {
+  jrpc_compress *c = conn->compress;
+
+  if( c == NULL ) {
+    return;
+  }
+#ifdef COMPRESS_DEFLATE
+  if( c->deflate_ready ) {
+    deflateEnd(&c->deflate);
+  }
+  if( c->inflate_ready ) {
+    inflateEnd(&c->inflate);
+  }
+#endif
+#ifdef COMPRESS_ZSTD
+  ZSTD_freeCCtx(c->cctx);
+  ZSTD_freeDCtx(c->dctx);
+#endif
+  free(c->frame);
+  free(c);
+  conn->compress = NULL;
+}
@@ -0,0 +1,414 @@
+/*
+ * jsonrpc-c-handover.c
+ *
+ *  Zero-downtime restarts.
+ *
+ *  A server with a handover_path listens on that Unix socket. A new
+ *  process started with the same path connects to it first and is
+ *  sent the listening sockets with SCM_RIGHTS, so the port is never
+ *  unbound: connections that arrive in the meantime wait in the
+ *  shared accept queue. Once the new process is set up it says so,
+ *  and the old one stops accepting and drains: once a connection
+ *  holds no partial request, queued output or stream, its read side
+ *  is shut down. Whatever raced in before that is still read and
+ *  answered, and the end of file that follows closes it the usual
+ *  way, after its output is flushed.
+ *
+ *  Whoever connects gets the listeners and can make us drain, so the
+ *  socket is created mode 0600 and peers running as another user
+ *  are refused.
+ */
+
+#include "jsonrpc-c-internal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// TCP and shared-memory listeners
+#define HANDOVER_MAX_FDS 2
+#define HANDOVER_READY 'R'
+#define DRAIN_INTERVAL 0.01
+
+typedef struct {
+  jrpc_server *server;
+  char *path;
+  ev_tstamp drain_timeout;
+
+  // listeners received from the previous process, until adopted
+  int adopted[HANDOVER_MAX_FDS];
+  // connection to the previous process, told once we are ready
+  int predecessor;
+
+  struct ev_io listen_watcher;
+  // connection to the next process until it is ready
+  struct ev_io successor_watcher;
+
+  int draining;
+  int forced;
+  ev_tstamp drain_start;
+  struct ev_timer drain_timer;
+} jrpc_handover;
+
+static
+int handover_address(const char *path, struct sockaddr_un *addr) {
+  if( strlen(path) >= sizeof(addr->sun_path) ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+//
+// New process
+//
+
+static
+int receive_listeners(jrpc_handover *h, int sock) {
+  char cmsg_buf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+  char count;
+  struct iovec iov = { &count, 1 };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int i, n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+  if( recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+      (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ) {
+    return -1;
+  }
+  n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  if( n != count || n < 1 || n > HANDOVER_MAX_FDS ) {
+    return -1;
+  }
+  memcpy(h->adopted, CMSG_DATA(cmsg), n * sizeof(int));
+
+  /* Both processes wait on the listeners for a moment; whichever
+     loses the race for a connection must not block in accept */
+  for( i = 0; i < n; i++ ) {
+    fcntl(h->adopted[i], F_SETFL,
+          fcntl(h->adopted[i], F_GETFL) | O_NONBLOCK);
+  }
+  return 0;
+}
+
+int jrpc_handover_adopt(jrpc_server *server,
+                        const jrpc_server_options *options) {
+  jrpc_handover *h;
+  struct sockaddr_un addr;
+  int fd, i;
+
+  if( (h = calloc(1, sizeof(jrpc_handover))) == NULL ||
+      (h->path = strdup(options->handover_path)) == NULL ) {
+    free(h);
+    return JRPC_ERROR;
+  }
+  h->server = server;
+  h->drain_timeout = options->drain_timeout;
+  for( i = 0; i < HANDOVER_MAX_FDS; i++ ) {
+    h->adopted[i] = -1;
+  }
+  h->predecessor = -1;
+  ev_io_init(&h->listen_watcher, NULL, -1, EV_READ);
+  ev_io_init(&h->successor_watcher, NULL, -1, EV_READ);
+  ev_timer_init(&h->drain_timer, NULL, 0., 0.);
+  server->handover = h;
+
+  if( handover_address(h->path, &addr) != 0 ||
+      (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ) {
+    return JRPC_ERROR;
+  }
+  if( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+    /* Nobody serves the path: a cold start */
+    close(fd);
+    return 0;
+  }
+  if( receive_listeners(h, fd) != 0 ) {
+#ifdef DEBUG
+    jrpc_set_error(server, errno, "handover", "No listeners received");
+#endif
+    close(fd);
+    return JRPC_ERROR;
+  }
+  h->predecessor = fd;
+  return 0;
+}
+
+int jrpc_handover_fd(jrpc_server *server, int index) {
+  jrpc_handover *h = (jrpc_handover*) server->handover;
+  int fd;
+
+  if( h == NULL ) {
+    return -1;
+  }
+  fd = h->adopted[index];
+  h->adopted[index] = -1;
+  return fd;
+}
+
+//
+// Old process
+//
+
+/* Quiet for a whole interval, and no request is partially read,
+   queued or being answered */
+static
+int connection_idle(jrpc_connection *conn, ev_tstamp now) {
+  return now - conn->received >= DRAIN_INTERVAL &&
+    conn->refs == 0 && conn->pos == 0 && conn->out_head == NULL &&
+    conn->stream == NULL && !conn->dirty;
+}
+
+/* Takes no more requests from an idle connection */
+static
+void connection_drain(jrpc_connection *conn) {
+  if( conn->protocol == JRPC_PROTOCOL_SHM ) {
+    /* The ring is ours to look at: close unless a request is in it */
+    if( !jrpc_shm_pending(conn) ) {
+      jrpc_connection_close(conn);
+    }
+    return;
+  }
+  /* Requests already in the socket are still read, evaluated and
+     answered by the backend, which then reads the end of file and
+     closes the connection once its output is flushed */
+  if( shutdown(conn->fd, SHUT_RD) != 0 ) {
+    jrpc_connection_close(conn);
+  }
+}
+
+static
+void drain_cb(struct ev_loop *loop,
+              struct ev_timer *w,
+              int revents) {
+  jrpc_handover *h = (jrpc_handover*) w->data;
+  jrpc_server *server = h->server;
+  jrpc_connection *conn, *next;
+  ev_tstamp now = ev_now(loop);
+  int expired = h->drain_timeout > 0 &&
+    now - h->drain_start >= h->drain_timeout;
+
+  /* Connections closed after the timeout had one interval to go */
+  if( server->connections == NULL || h->forced ) {
+    ev_timer_stop(loop, w);
+    jrpc_server_stop(server);
+    return;
+  }
+  for( conn = server->connections; conn != NULL; conn = next ) {
+    next = conn->next;
+    if( conn->closing ) {
+      continue;
+    }
+    if( expired ) {
+      jrpc_connection_close(conn);
+    } else if( connection_idle(conn, now) ) {
+      connection_drain(conn);
+    }
+  }
+  h->forced = expired;
+}
+
+static
+void handover_drain(jrpc_handover *h) {
+  jrpc_server *server = h->server;
+  struct ev_loop *loop = server->loop;
+
+  h->draining = 1;
+
+  /* The path belongs to the new process now */
+  ev_io_stop(loop, &h->listen_watcher);
+  close(h->listen_watcher.fd);
+
+  jrpc_accept_stop(server);
+  close(server->listen_watcher.fd);
+  if( server->shm_path != NULL && ev_is_active(&server->shm_watcher) ) {
+    ev_io_stop(loop, &server->shm_watcher);
+    close(server->shm_watcher.fd);
+  }
+
+  h->drain_start = ev_now(loop);
+  ev_timer_init(&h->drain_timer, drain_cb, 0., DRAIN_INTERVAL);
+  h->drain_timer.data = h;
+  ev_timer_start(loop, &h->drain_timer);
+}
+
+static
+void successor_cb(struct ev_loop *loop,
+                  struct ev_io *w,
+                  int revents) {
+  jrpc_handover *h = (jrpc_handover*) w->data;
+  char ready = 0;
+  ssize_t n = recv(w->fd, &ready, 1, 0);
+
+  if( n < 0 && (errno == EAGAIN || errno == EINTR) ) {
+    return;
+  }
+  ev_io_stop(loop, w);
+  close(w->fd);
+  /* Otherwise the new process failed to start: keep serving */
+  if( n == 1 && ready == HANDOVER_READY ) {
+    handover_drain(h);
+  }
+}
+
+static
+int send_listeners(int sock, int *fds, int count) {
+  char cmsg_buf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+  char n = count;
+  struct iovec iov = { &n, 1 };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cmsg_buf, 0, sizeof(cmsg_buf));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* Only a process of our own user may take over */
+static
+int peer_trusted(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+    cred.uid == geteuid();
+}
+
+static
+void handover_accept_cb(struct ev_loop *loop,
+                        struct ev_io *w,
+                        int revents) {
+  jrpc_handover *h = (jrpc_handover*) w->data;
+  jrpc_server *server = h->server;
+  int fds[HANDOVER_MAX_FDS], count = 0;
+  int fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC);
+
+  if( fd == -1 ) {
+    return;
+  }
+  if( !peer_trusted(fd) ) {
+#ifdef DEBUG
+    jrpc_set_error(server, -1, "handover", "peer of another user refused");
+#endif
+    close(fd);
+    return;
+  }
+  /* One successor at a time */
+  if( h->draining || ev_is_active(&h->successor_watcher) ) {
+    close(fd);
+    return;
+  }
+
+  fds[count++] = server->listen_watcher.fd;
+  if( server->shm_path != NULL && ev_is_active(&server->shm_watcher) ) {
+    fds[count++] = server->shm_watcher.fd;
+  }
+  /* We keep accepting until the new process is ready */
+  if( send_listeners(fd, fds, count) != 0 ) {
+    close(fd);
+    return;
+  }
+  ev_io_init(&h->successor_watcher, successor_cb, fd, EV_READ);
+  h->successor_watcher.data = h;
+  ev_io_start(loop, &h->successor_watcher);
+}
+
+//
+// Both
+//
+
+int jrpc_handover_start(jrpc_server *server) {
+  jrpc_handover *h = (jrpc_handover*) server->handover;
+  struct sockaddr_un addr;
+  char ready = HANDOVER_READY;
+  int fd, i;
+
+  if( h == NULL ) {
+    return 0;
+  }
+  /* Listeners of the previous process we do not serve */
+  for( i = 0; i < HANDOVER_MAX_FDS; i++ ) {
+    if( h->adopted[i] >= 0 ) {
+      close(h->adopted[i]);
+      h->adopted[i] = -1;
+    }
+  }
+
+  /* The previous process still listens on the old path, unlinked */
+  if( handover_address(h->path, &addr) != 0 ) {
+    return JRPC_ERROR;
+  }
+  unlink(h->path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if( fd == -1 ) {
+    return JRPC_ERROR;
+  }
+  if( bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      chmod(h->path, 0600) == -1 ||
+      listen(fd, 1) == -1 ) {
+    close(fd);
+    return JRPC_ERROR;
+  }
+  ev_io_init(&h->listen_watcher, handover_accept_cb, fd, EV_READ);
+  h->listen_watcher.data = h;
+  ev_io_start(server->loop, &h->listen_watcher);
+
+  if( h->predecessor >= 0 ) {
+    send(h->predecessor, &ready, 1, MSG_NOSIGNAL);
+    close(h->predecessor);
+    h->predecessor = -1;
+  }
+  return 0;
+}
+
+int jrpc_server_draining(jrpc_server *server) {
+  jrpc_handover *h = (jrpc_handover*) server->handover;
+  return h != NULL && h->draining;
+}
+
+void jrpc_handover_destroy(jrpc_server *server) {
+  jrpc_handover *h = (jrpc_handover*) server->handover;
+  int i;
+
+  if( h == NULL ) {
+    return;
+  }
+  if( ev_is_active(&h->listen_watcher) ) {
+    ev_io_stop(server->loop, &h->listen_watcher);
+    close(h->listen_watcher.fd);
+    unlink(h->path);
+  }
+  if( ev_is_active(&h->successor_watcher) ) {
+    ev_io_stop(server->loop, &h->successor_watcher);
+    close(h->successor_watcher.fd);
+  }
+  ev_timer_stop(server->loop, &h->drain_timer);
+  for( i = 0; i < HANDOVER_MAX_FDS; i++ ) {
+    if( h->adopted[i] >= 0 ) {
+      close(h->adopted[i]);
+    }
+  }
+  if( h->predecessor >= 0 ) {
+    close(h->predecessor);
+  }
+  free(h->path);
+  free(h);
+  server->handover = NULL;
+}
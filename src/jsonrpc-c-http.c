@@ -0,0 +1,306 @@
+/*
+ * jsonrpc-c-http.c
+ *
+ *  HTTP/1.1 transport.
+ *
+ *  When jrpc_server_options.http is set, a connection whose first
+ *  bytes look like a request line is served as HTTP: each POST body
+ *  is one JSON-RPC request, connections are kept alive and pipelined
+ *  requests are answered in order. Responses carry a Content-Length;
+ *  only streamed results (jrpc_stream_*) use chunked transfer
+ *  encoding. Bodies larger than http_max_body are refused.
+ */
+
+#include "jsonrpc-c-internal.h"
+
+#include <strings.h>
+
+#define HTTP_MAX_HEAD 8192
+
+static jrpc_buffer crlf_buffer = { 1, 2, { '\r', '\n' } };
+static jrpc_buffer last_chunk_buffer = { 1, 5, { '0', '\r', '\n', '\r', '\n' } };
+
+typedef struct {
+  const char *method;
+  size_t method_len;
+  size_t content_length;
+  int chunked;
+  int expect_continue;
+} http_request;
+
+static
+int queue_text(jrpc_connection *conn, const char *text, size_t len) {
+  jrpc_buffer *buf = jrpc_buffer_new(text, len);
+  int result;
+  if( buf == NULL ) {
+    return -1;
+  }
+  result = jrpc_connection_queue(conn, buf, buf->data, buf->len, 0);
+  jrpc_buffer_unref(buf);
+  return result;
+}
+
+static
+const char* connection_header(jrpc_connection *conn) {
+  if( !conn->http_keep_alive ) {
+    return "Connection: close\r\n";
+  }
+  return conn->http_minor == 0 ? "Connection: keep-alive\r\n" : "";
+}
+
+/* A response without a JSON-RPC body */
+static
+int send_status(jrpc_connection *conn,
+                const char *status,
+                const char *headers) {
+  char head[256];
+  int len = snprintf(head, sizeof(head), "HTTP/1.%d %s\r\n%s%s\r\n",
+                     conn->http_minor, status, headers,
+                     connection_header(conn));
+  return queue_text(conn, head, len);
+}
+
+int jrpc_http_send(jrpc_connection *conn, jrpc_buffer *body) {
+  char head[256];
+  int len;
+
+  /* The length is known, however large: no need for chunks */
+  len = snprintf(head, sizeof(head),
+                 "HTTP/1.%d 200 OK\r\n"
+                 "Content-Type: application/json\r\n"
+                 "Content-Length: %zu\r\n%s\r\n",
+                 conn->http_minor, body->len, connection_header(conn));
+  if( queue_text(conn, head, len) != 0 ) {
+    return -1;
+  }
+  return jrpc_connection_queue(conn, body, body->data, body->len, 0);
+}
+
+int jrpc_http_stream_begin(jrpc_connection *conn) {
+  char head[256];
+  int len;
+
+  if( conn->http_minor == 0 ) {
+    /* No chunked encoding: the body ends with the connection */
+    conn->http_keep_alive = 0;
+    len = snprintf(head, sizeof(head),
+                   "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: application/json\r\n%s\r\n",
+                   connection_header(conn));
+    return queue_text(conn, head, len) == 0 ? 0 : -1;
+  }
+  len = snprintf(head, sizeof(head),
+                 "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: application/json\r\n"
+                 "Transfer-Encoding: chunked\r\n%s\r\n",
+                 connection_header(conn));
+  return queue_text(conn, head, len) == 0 ? 1 : -1;
+}
+
+int jrpc_http_queue_chunk(jrpc_connection *conn,
+                          jrpc_buffer *buf,
+                          const char *data,
+                          size_t len) {
+  char size_line[32];
+  int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+
+  if( queue_text(conn, size_line, n) != 0 ||
+      jrpc_connection_queue(conn, buf, data, len, 0) != 0 ) {
+    return -1;
+  }
+  return jrpc_connection_queue(conn, &crlf_buffer, crlf_buffer.data, 2, 0);
+}
+
+int jrpc_http_stream_end(jrpc_connection *conn, int chunked) {
+  if( !chunked ) {
+    return 0;
+  }
+  return jrpc_connection_queue(conn, &last_chunk_buffer,
+                               last_chunk_buffer.data, 5, 0);
+}
+
+static
+int header_is(const char *line, size_t len, const char *name) {
+  size_t n = strlen(name);
+  return len > n && line[n] == ':' && strncasecmp(line, name, n) == 0;
+}
+
+static
+int value_has(const char *value, size_t len, const char *token) {
+  size_t n = strlen(token);
+  for( size_t i = 0; i + n <= len; i++ ) {
+    if( strncasecmp(value + i, token, n) == 0 ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Parses a Content-Length value: digits, then optional whitespace.
+   Returns -1 if it is malformed or does not fit a size_t. */
+static
+int parse_length(const char *value, size_t len, size_t *length) {
+  size_t n = 0, i;
+
+  for( i = 0; i < len && value[i] >= '0' && value[i] <= '9'; i++ ) {
+    if( n > (SIZE_MAX - (value[i] - '0')) / 10 ) {
+      return -1;
+    }
+    n = n * 10 + (value[i] - '0');
+  }
+  if( i == 0 ) {
+    return -1;
+  }
+  for( ; i < len; i++ ) {
+    if( value[i] != ' ' && value[i] != '\t' ) {
+      return -1;
+    }
+  }
+  *length = n;
+  return 0;
+}
+
+/* Parses the request head in buf[0..len). Returns NULL, or the
+   status line to reject the request with. */
+static
+const char* parse_head(jrpc_connection *conn,
+                       const char *buf,
+                       size_t len,
+                       http_request *req) {
+  const char *line = buf, *end = buf + len, *eol, *sp, *value;
+  size_t line_len, value_len, length;
+  int has_length = 0;
+
+  memset(req, 0, sizeof(http_request));
+  /* Rejected before the version is known, answer as HTTP/1.1 */
+  conn->http_minor = 1;
+
+  /* Request line: METHOD SP target SP HTTP/1.x */
+  eol = memchr(line, '\r', end - line);
+  sp = memchr(line, ' ', eol - line);
+  if( sp == NULL || sp == line ) {
+    return "400 Bad Request";
+  }
+  req->method = line;
+  req->method_len = sp - line;
+  if( eol - buf < 8 || memcmp(eol - 8, "HTTP/1.", 7) != 0 ||
+      (eol[-1] != '0' && eol[-1] != '1') ) {
+    return "505 HTTP Version Not Supported";
+  }
+  conn->http_minor = eol[-1] - '0';
+  conn->http_keep_alive = conn->http_minor == 1;
+
+  for( line = eol + 2; line < end - 2; line = eol + 2 ) {
+    eol = memchr(line, '\r', end - line);
+    line_len = eol - line;
+    value = memchr(line, ':', line_len);
+    if( value == NULL ) {
+      return "400 Bad Request";
+    }
+    for( value++; value < eol && (*value == ' ' || *value == '\t'); ) {
+      value++;
+    }
+    value_len = eol - value;
+
+    if( header_is(line, line_len, "Content-Length") ) {
+      /* Repeated, the values must agree */
+      if( parse_length(value, value_len, &length) != 0 ||
+          (has_length && length != req->content_length) ) {
+        return "400 Bad Request";
+      }
+      req->content_length = length;
+      has_length = 1;
+    } else if( header_is(line, line_len, "Transfer-Encoding") ) {
+      req->chunked = 1;
+    } else if( header_is(line, line_len, "Connection") ) {
+      if( value_has(value, value_len, "close") ) {
+        conn->http_keep_alive = 0;
+      } else if( value_has(value, value_len, "keep-alive") ) {
+        conn->http_keep_alive = 1;
+      }
+    } else if( header_is(line, line_len, "Expect") ) {
+      req->expect_continue = value_has(value, value_len, "100-continue");
+    }
+  }
+
+  if( req->chunked ) {
+    /* Request bodies must come with a Content-Length */
+    return "411 Length Required";
+  }
+  if( req->content_length > conn->server->http_max_body ) {
+    return "413 Content Too Large";
+  }
+  return NULL;
+}
+
+static
+int reject(jrpc_connection *conn, const char *status) {
+  conn->http_keep_alive = 0;
+  send_status(conn, status, "Content-Length: 0\r\n");
+  jrpc_connection_close(conn);
+  return -1;
+}
+
+int jrpc_http_handle(jrpc_connection *conn) {
+  http_request req;
+  const char *status;
+  char *end;
+  size_t head_len, skip;
+
+  while( conn->pos > 0 && !conn->closing && conn->stream == NULL ) {
+
+    /* Empty lines between pipelined requests are ignored */
+    for( skip = 0; skip < (size_t) conn->pos &&
+           (conn->buffer[skip] == '\r' || conn->buffer[skip] == '\n'); ) {
+      skip++;
+    }
+    if( skip > 0 ) {
+      jrpc_connection_shift(conn, skip);
+      continue;
+    }
+
+    end = memmem(conn->buffer, conn->pos, "\r\n\r\n", 4);
+    if( end == NULL ) {
+      if( conn->pos > HTTP_MAX_HEAD ) {
+        conn->http_minor = 1;
+        return reject(conn, "431 Request Header Fields Too Large");
+      }
+      break;
+    }
+    head_len = end - conn->buffer + 4;
+
+    if( (status = parse_head(conn, conn->buffer, head_len, &req)) != NULL ) {
+      return reject(conn, status);
+    }
+
+    if( req.content_length > conn->pos - head_len ) {
+      /* Wait for the rest of the body */
+      if( req.expect_continue && !conn->http_continue ) {
+        conn->http_continue = 1;
+        queue_text(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+      }
+      break;
+    }
+
+    conn->responded = 0;
+    if( req.method_len == 4 && memcmp(req.method, "POST", 4) == 0 ) {
+      jrpc_connection_eval(conn, conn->buffer + head_len,
+                           req.content_length);
+      if( !conn->responded && !conn->closing ) {
+        /* A JSON-RPC notification has no response */
+        send_status(conn, "204 No Content", "");
+      }
+    } else {
+      send_status(conn, "405 Method Not Allowed",
+                  "Allow: POST\r\nContent-Length: 0\r\n");
+    }
+
+    jrpc_connection_shift(conn, head_len + req.content_length);
+    conn->http_continue = 0;
+
+    if( !conn->http_keep_alive && conn->stream == NULL ) {
+      jrpc_connection_close(conn);
+    }
+  }
+  return conn->closing ? -1 : 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * jsonrpc-c-internal.h
+ *
+ *  Declarations shared between the core and the I/O backends.
+ *  Not installed.
+ */
+
+#ifndef JSONRPCC_INTERNAL_H_
+#define JSONRPCC_INTERNAL_H_
+
+#include "jsonrpc-c.h"
+
+#ifdef DEBUG
+
+//
+// Debugging (jsonrpc-c.c)
+//
+
+// Records the last error in server->error
+void jrpc_set_error(jrpc_server *server,
+                    int code,
+                    const char *cause,
+                    const char *msg);
+
+#endif
+
+//
+// Output (jsonrpc-c.c)
+//
+
+// Serialized output, shared by every connection it is queued on
+typedef struct jrpc_buffer {
+  int refcount;
+  size_t len;
+  char data[];
+} jrpc_buffer;
+
+// A queued slice of a buffer
+typedef struct jrpc_output {
+  struct jrpc_output *next;
+  jrpc_buffer *buf;
+  const char *data;
+  size_t len;
+  // method hash for notifications, 0 for responses
+  uint32_t key;
+} jrpc_output;
+
+// Copies data, refcount starts at 1
+jrpc_buffer* jrpc_buffer_new(const char *data, size_t len);
+
+void jrpc_buffer_unref(jrpc_buffer *buf);
+
+// Lists the connection for the next flush_cb
+void jrpc_connection_dirty(jrpc_connection *conn);
+
+// Queues a slice of buf as is (taking a reference) and schedules
+// a flush
+int jrpc_connection_queue(jrpc_connection *conn,
+                          jrpc_buffer *buf,
+                          const char *data,
+                          size_t len,
+                          uint32_t key);
+
+// Compressed forms of one message by algorithm, so that sending it to
+// many connections compresses it once per algorithm
+#define JRPC_FRAME_CACHE (JRPC_COMPRESSION_ZSTD + 1)
+
+// Queues one message in the connection's transport framing,
+// applying the overflow policy to notifications (key != 0).
+// frames is a JRPC_FRAME_CACHE array, or NULL.
+int jrpc_connection_send(jrpc_connection *conn,
+                         jrpc_buffer *buf,
+                         uint32_t key,
+                         jrpc_buffer **frames);
+
+// Pops len sent bytes off the queue
+void jrpc_connection_consume(jrpc_connection *conn, size_t len);
+
+void jrpc_connection_drop_output(jrpc_connection *conn);
+
+//
+// Connections (jsonrpc-c.c)
+//
+
+jrpc_connection* jrpc_connection_new(jrpc_server *server, int fd);
+
+// Applies the listener's per-socket options to an accepted fd, then
+// wraps it; closes the fd on failure
+jrpc_connection* jrpc_connection_accept(jrpc_server *server, int fd);
+
+void jrpc_connection_free(jrpc_connection *conn);
+
+// Stops accepting after accept failed with err (EMFILE, ENFILE),
+// which is recorded once rather than on every retry; accepting
+// resumes after JRPC_ACCEPT_RETRY or once a connection is freed
+void jrpc_accept_pause(jrpc_server *server, int err);
+
+// Stops accepting for good (handover)
+void jrpc_accept_stop(jrpc_server *server);
+
+// Stops reading; the connection is freed once its output is flushed
+void jrpc_connection_close(jrpc_connection *conn);
+
+// The client sent EOF: closes the connection, unless a result is
+// being streamed and keep_on_half_close lets it finish first
+void jrpc_connection_eof(jrpc_connection *conn);
+
+// Frees a closing connection without holds, queued or pending output
+void jrpc_connection_release(jrpc_connection *conn);
+
+// Makes room for len more bytes of input and returns where they go;
+// the caller advances pos. NULL if out of memory.
+char* jrpc_connection_reserve(jrpc_connection *conn, size_t len);
+
+// Appends received bytes to the input buffer and evaluates every
+// complete request in it. Returns -1 if the connection was closed.
+int jrpc_connection_feed(jrpc_connection *conn,
+                         const char *data,
+                         size_t len);
+
+// Parses and evaluates one request body
+void jrpc_connection_eval(jrpc_connection *conn,
+                          const char *data,
+                          size_t len);
+
+// Drops the first len bytes of the input buffer
+void jrpc_connection_shift(jrpc_connection *conn, size_t len);
+
+//
+// HTTP/1.1 transport (jsonrpc-c-http.c)
+//
+
+// Evaluates the complete requests in the input buffer.
+// Returns -1 if the connection was closed.
+int jrpc_http_handle(jrpc_connection *conn);
+
+int jrpc_http_send(jrpc_connection *conn, jrpc_buffer *body);
+
+// Queues the response head of a body of unknown length. Returns 1
+// if the body must be sent in chunks, 0 if it ends with the
+// connection, -1 on error.
+int jrpc_http_stream_begin(jrpc_connection *conn);
+
+int jrpc_http_queue_chunk(jrpc_connection *conn,
+                          jrpc_buffer *buf,
+                          const char *data,
+                          size_t len);
+
+int jrpc_http_stream_end(jrpc_connection *conn, int chunked);
+
+//
+// Streamed results (jsonrpc-c-stream.c)
+//
+
+struct jrpc_stream {
+  jrpc_connection *conn;
+  jrpc_stream_fn produce;
+  void *data;
+  size_t high_water;
+  // writes are collected into chunks before they are queued
+  jrpc_buffer *pending;
+  int mode;
+  int chunked;
+  int producing;
+};
+
+// Calls produce until the high-water mark is reached. Returns 1 if
+// the stream ended.
+int jrpc_stream_pump(jrpc_connection *conn);
+
+// Ends the stream of a closing connection
+void jrpc_stream_abort(jrpc_connection *conn);
+
+//
+// io_uring backend (jsonrpc-c-uring.c)
+//
+
+int jrpc_uring_start(jrpc_server *server, int listen_fd);
+
+// Tears the ring down and frees the backend state of the connections
+// still open; the connections themselves are left to the caller
+void jrpc_uring_destroy(jrpc_server *server);
+
+// Turns the connection's queued output into a send operation
+void jrpc_uring_flush(jrpc_connection *conn);
+
+// Submits everything prepared during this loop iteration
+void jrpc_uring_submit(jrpc_server *server);
+
+// Cancels the multishot accept for good
+void jrpc_uring_stop_accept(jrpc_server *server);
+
+void jrpc_uring_close(jrpc_connection *conn);
+
+//
+// Listener handover (jsonrpc-c-handover.c)
+//
+
+// Takes the listeners of the previous process on handover_path
+int jrpc_handover_adopt(jrpc_server *server,
+                        const jrpc_server_options *options);
+
+// Returns an adopted listener (0: TCP, 1: shared memory) and gives
+// up its ownership, or -1
+int jrpc_handover_fd(jrpc_server *server, int index);
+
+// Serves handover_path for the next process
+int jrpc_handover_start(jrpc_server *server);
+
+void jrpc_handover_destroy(jrpc_server *server);
+
+//
+// Shared-memory transport (jsonrpc-c-shm.c)
+//
+
+int jrpc_shm_start(jrpc_server *server);
+
+void jrpc_shm_destroy(jrpc_server *server);
+
+// Copies queued output into the connection's response ring
+void jrpc_shm_flush(jrpc_connection *conn);
+
+// Stops polling the rings of a closing connection
+void jrpc_shm_close(jrpc_connection *conn);
+
+void jrpc_shm_free(jrpc_connection *conn);
+
+// Requests not yet taken from the connection's ring
+int jrpc_shm_pending(jrpc_connection *conn);
+
+//
+// Compression (jsonrpc-c-compress.c)
+//
+
+// The "rpc.compress" procedure
+json_t* jrpc_compress_negotiate(jrpc_context *ctx,
+                                json_t *params,
+                                json_t *id);
+
+// Returns a new reference to what to queue for buf: its compressed
+// frames, or buf itself. NULL on error. Frames are taken from and
+// added to the frames cache if it is not NULL.
+jrpc_buffer* jrpc_compress_buffer(jrpc_connection *conn,
+                                  jrpc_buffer *buf,
+                                  jrpc_buffer **frames);
+
+// Appends received bytes to the input buffer, expanding frames
+int jrpc_compress_feed(jrpc_connection *conn,
+                       const char *data,
+                       size_t len);
+
+void jrpc_compress_free(jrpc_connection *conn);
+
+//
+// Parameter schemas (jsonrpc-c-schema.c)
+//
+
+// NULL if schema is malformed or uses an unsupported keyword
+jrpc_schema* jrpc_schema_compile(json_t *schema);
+
+void jrpc_schema_free(jrpc_schema *schema);
+
+// Returns 0 if params match, else fills in the context's error.
+// A NULL schema matches anything.
+int jrpc_schema_check(const jrpc_schema *schema,
+                      json_t *params,
+                      jrpc_context *ctx);
+
+//
+// Deadlines and cancellation (jsonrpc-c-cancel.c)
+//
+
+void jrpc_cancel_init(jrpc_connection *conn);
+
+// Resets the connection's token for a new request
+void jrpc_cancel_arm(jrpc_connection *conn, ev_tstamp deadline);
+
+// Fires the token on its deadline while the loop runs, for
+// requests that outlive their procedure call
+void jrpc_cancel_watch(jrpc_connection *conn);
+
+// The request completed
+void jrpc_cancel_disarm(jrpc_connection *conn);
+
+void jrpc_cancel_fire(jrpc_cancel *token);
+
+int jrpc_cancel_expired(jrpc_cancel *token);
+
+//
+// Notifications (jsonrpc-c-notify.c)
+//
+
+void jrpc_group_leave_all(jrpc_connection *conn);
+
+void jrpc_group_destroy_all(jrpc_server *server);
+
+#endif
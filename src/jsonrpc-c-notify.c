@@ -0,0 +1,238 @@
+/*
+ * jsonrpc-c-notify.c
+ *
+ *  Server-initiated notifications and named connection groups.
+ *
+ *  A broadcast serializes its notification once into a shared
+ *  jrpc_buffer that every member's output queue references, so the
+ *  cost of a broadcast does not grow with the serialization work per
+ *  subscriber; members that negotiated compression share one
+ *  compressed copy per algorithm. Members above the server's output high-water mark are
+ *  handled by its overflow policy.
+ */
+
+#include "jsonrpc-c-internal.h"
+
+typedef struct jrpc_group {
+  struct jrpc_group *next;
+  char *name;
+  uint32_t name_hash;
+  jrpc_connection **members;
+  int member_count;
+  int member_size;
+} jrpc_group;
+
+static
+jrpc_group* find_group(jrpc_server *server,
+                       const char *name,
+                       int create) {
+  uint32_t hash = jrpc_name_hash(name);
+  jrpc_group *group;
+
+  for( group = server->groups; group != NULL; group = group->next ) {
+    if( group->name_hash == hash && strcmp(group->name, name) == 0 ) {
+      return group;
+    }
+  }
+  if( !create || (group = calloc(1, sizeof(jrpc_group))) == NULL ) {
+    return NULL;
+  }
+  if( (group->name = strdup(name)) == NULL ) {
+    free(group);
+    return NULL;
+  }
+  group->name_hash = hash;
+  group->next = server->groups;
+  server->groups = group;
+  return group;
+}
+
+static
+jrpc_buffer* notification_buffer(const char *method,
+                                 json_t *params) {
+  jrpc_buffer *buf = NULL;
+  json_t *json;
+  char *str;
+
+  if( params != NULL ) {
+    json = json_pack("{s:s,s:s,s:O}",
+                     "jsonrpc", "2.0",
+                     "method", method,
+                     "params", params);
+  } else {
+    json = json_pack("{s:s,s:s}",
+                     "jsonrpc", "2.0",
+                     "method", method);
+  }
+  if( json == NULL ) {
+    return NULL;
+  }
+  str = json_dumps(json, JSON_COMPACT | JSON_PRESERVE_ORDER);
+  if( str != NULL ) {
+    buf = jrpc_buffer_new(str, strlen(str));
+    free(str);
+  }
+  json_decref(json);
+  return buf;
+}
+
+int jrpc_notify(jrpc_connection *conn,
+                const char *method,
+                json_t *params) {
+  jrpc_buffer *buf = notification_buffer(method, params);
+  int result;
+
+  if( buf == NULL ) {
+    return -1;
+  }
+  result = jrpc_connection_send(conn, buf, jrpc_name_hash(method), NULL);
+  jrpc_buffer_unref(buf);
+  return result;
+}
+
+int jrpc_broadcast(jrpc_server *server,
+                   const char *group_name,
+                   const char *method,
+                   json_t *params) {
+  jrpc_group *group = find_group(server, group_name, 0);
+  uint32_t key = jrpc_name_hash(method);
+  jrpc_buffer *buf, *frames[JRPC_FRAME_CACHE] = { NULL };
+  int i, count = 0;
+
+  if( group == NULL || group->member_count == 0 ) {
+    return 0;
+  }
+  if( (buf = notification_buffer(method, params)) == NULL ) {
+    return -1;
+  }
+
+  /* Backwards: a member disconnected by the overflow policy leaves
+     the group, moving the last (already visited) member into its
+     slot */
+  for( i = group->member_count - 1; i >= 0; i-- ) {
+    if( jrpc_connection_send(group->members[i], buf, key, frames) == 0 ) {
+      count++;
+    }
+  }
+
+  for( i = 0; i < JRPC_FRAME_CACHE; i++ ) {
+    if( frames[i] != NULL ) {
+      jrpc_buffer_unref(frames[i]);
+    }
+  }
+  jrpc_buffer_unref(buf);
+  return count;
+}
+
+int jrpc_group_join(jrpc_connection *conn,
+                    const char *name) {
+  jrpc_group *group;
+  jrpc_membership *groups;
+  int i;
+
+  if( conn->closing ||
+      (group = find_group(conn->server, name, 1)) == NULL ) {
+    return -1;
+  }
+  for( i = 0; i < conn->group_count; i++ ) {
+    if( conn->groups[i].group == group ) {
+      return 0;
+    }
+  }
+
+  if( group->member_count == group->member_size ) {
+    int size = group->member_size > 0 ? group->member_size * 2 : 16;
+    jrpc_connection **members =
+      realloc(group->members, sizeof(jrpc_connection*) * size);
+    if( members == NULL ) {
+      return -1;
+    }
+    group->members = members;
+    group->member_size = size;
+  }
+
+  groups = realloc(conn->groups,
+                   sizeof(jrpc_membership) * (conn->group_count + 1));
+  if( groups == NULL ) {
+    return -1;
+  }
+  conn->groups = groups;
+  conn->groups[conn->group_count].group = group;
+  conn->groups[conn->group_count].index = group->member_count;
+  conn->group_count++;
+
+  group->members[group->member_count++] = conn;
+  return 0;
+}
+
+static
+void free_group(jrpc_group *group) {
+  free(group->members);
+  free(group->name);
+  free(group);
+}
+
+/* Unlinks and frees a group its last member has left */
+static
+void remove_group(jrpc_server *server, jrpc_group *group) {
+  jrpc_group **link;
+
+  for( link = &server->groups; *link != NULL; link = &(*link)->next ) {
+    if( *link == group ) {
+      *link = group->next;
+      free_group(group);
+      return;
+    }
+  }
+}
+
+static
+void leave_membership(jrpc_connection *conn, int m) {
+  jrpc_group *group = conn->groups[m].group;
+  int index = conn->groups[m].index;
+  jrpc_connection *last = group->members[--group->member_count];
+
+  /* Move the last member into the freed slot */
+  group->members[index] = last;
+  if( last != conn ) {
+    for( int i = 0; i < last->group_count; i++ ) {
+      if( last->groups[i].group == group ) {
+        last->groups[i].index = index;
+        break;
+      }
+    }
+  }
+
+  conn->groups[m] = conn->groups[--conn->group_count];
+  if( group->member_count == 0 ) {
+    remove_group(conn->server, group);
+  }
+}
+
+int jrpc_group_leave(jrpc_connection *conn,
+                     const char *name) {
+  jrpc_group *group = find_group(conn->server, name, 0);
+
+  for( int i = 0; group != NULL && i < conn->group_count; i++ ) {
+    if( conn->groups[i].group == group ) {
+      leave_membership(conn, i);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void jrpc_group_leave_all(jrpc_connection *conn) {
+  while( conn->group_count > 0 ) {
+    leave_membership(conn, conn->group_count - 1);
+  }
+}
+
+void jrpc_group_destroy_all(jrpc_server *server) {
+  jrpc_group *group, *next;
+  for( group = server->groups; group != NULL; group = next ) {
+    next = group->next;
+    free_group(group);
+  }
+  server->groups = NULL;
+}
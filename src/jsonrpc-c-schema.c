@@ -0,0 +1,638 @@
+/*
+ * jsonrpc-c-schema.c
+ *
+ *  Parameter schemas.
+ *
+ *  A procedure's params schema is compiled once, when the procedure
+ *  is registered, into a flat array of checks. Each schema (and each
+ *  subschema) is a run of checks ending with OP_END; checks on
+ *  elements and members refer to the run of their subschema by
+ *  index. Checking a request walks that array, so a mismatch costs
+ *  no allocation until the error is reported.
+ *
+ *  Supported keywords: type, enum, const, minLength, maxLength,
+ *  minimum, maximum, exclusiveMinimum, exclusiveMaximum, items,
+ *  prefixItems, minItems, maxItems, properties, required and
+ *  additionalProperties, plus boolean schemas. Annotations are
+ *  ignored; any other keyword fails the compilation rather than
+ *  being silently skipped.
+ */
+
+#include <stdarg.h>
+
+#include "jsonrpc-c-internal.h"
+
+enum {
+  OP_END = 0,
+  OP_FAIL,           // false schema
+  OP_TYPE,           // n: mask of TYPE_ bits
+  OP_ENUM,           // arg.value: array of allowed values
+  OP_CONST,          // arg.value
+  OP_MIN_LENGTH,     // n, in characters
+  OP_MAX_LENGTH,
+  OP_MIN_ITEMS,      // n
+  OP_MAX_ITEMS,
+  OP_MINIMUM,        // arg.number
+  OP_MAXIMUM,
+  OP_EXCLUSIVE_MINIMUM,
+  OP_EXCLUSIVE_MAXIMUM,
+  OP_ITEM,           // element n, if present, matches child
+  OP_ITEMS,          // elements from n on match child
+  OP_PROPERTY,       // member arg.key, if present, matches child
+  OP_REQUIRED,       // member arg.key is present
+  OP_ADDITIONAL      // members without an OP_PROPERTY among the n
+                     // checks before this one match child
+};
+
+enum {
+  TYPE_NULL = 1,
+  TYPE_BOOLEAN = 2,
+  TYPE_INTEGER = 4,
+  TYPE_NUMBER = 8,
+  TYPE_STRING = 16,
+  TYPE_ARRAY = 32,
+  TYPE_OBJECT = 64
+};
+
+static const struct {
+  const char *name;
+  int mask;
+} type_names[] = {
+  { "null", TYPE_NULL },
+  { "boolean", TYPE_BOOLEAN },
+  { "integer", TYPE_INTEGER },
+  { "number", TYPE_INTEGER | TYPE_NUMBER },
+  { "string", TYPE_STRING },
+  { "array", TYPE_ARRAY },
+  { "object", TYPE_OBJECT }
+};
+
+#define TYPE_COUNT (sizeof(type_names) / sizeof(*type_names))
+
+// Keywords with a count or number operand
+static const struct {
+  const char *keyword;
+  int op;
+} limits[] = {
+  { "minLength", OP_MIN_LENGTH },
+  { "maxLength", OP_MAX_LENGTH },
+  { "minItems", OP_MIN_ITEMS },
+  { "maxItems", OP_MAX_ITEMS },
+  { "minimum", OP_MINIMUM },
+  { "maximum", OP_MAXIMUM },
+  { "exclusiveMinimum", OP_EXCLUSIVE_MINIMUM },
+  { "exclusiveMaximum", OP_EXCLUSIVE_MAXIMUM }
+};
+
+typedef struct {
+  int op;
+  int child;          // index of a subschema's first check
+  size_t n;
+  union {
+    double number;
+    json_t *value;
+    const char *key;
+  } arg;
+} schema_op;
+
+struct jrpc_schema {
+  // the compiled schema's own copy, which keys and values point into
+  json_t *source;
+  int count;
+  schema_op ops[];
+};
+
+// Checks being compiled, with the subschemas still to compile
+typedef struct {
+  schema_op *ops;
+  json_t **pending;
+  int count;
+  int size;
+} schema_compiler;
+
+// Where in params a check runs, linked to the enclosing element
+typedef struct schema_path {
+  const struct schema_path *parent;
+  const char *key;     // member name, or NULL for element index
+  size_t index;
+} schema_path;
+
+// A mismatch, with its JSON Pointer into params
+typedef struct {
+  char path[256];
+  char reason[96];
+} schema_error;
+
+//
+// Compilation
+//
+
+static
+schema_op* emit(schema_compiler *c, int op, json_t *child) {
+  schema_op *ops;
+  json_t **pending;
+
+  if( c->count == c->size ) {
+    c->size = c->size > 0 ? c->size * 2 : 16;
+    if( (ops = realloc(c->ops, c->size * sizeof(schema_op))) == NULL ) {
+      return NULL;
+    }
+    c->ops = ops;
+    if( (pending = realloc(c->pending, c->size * sizeof(json_t*))) == NULL ) {
+      return NULL;
+    }
+    c->pending = pending;
+  }
+  memset(&c->ops[c->count], 0, sizeof(schema_op));
+  c->ops[c->count].op = op;
+  c->pending[c->count] = child;
+  return &c->ops[c->count++];
+}
+
+static
+int type_mask(json_t *type) {
+  json_t *name;
+  size_t i, j;
+  int mask = 0;
+
+  if( json_is_string(type) ) {
+    for( j = 0; j < TYPE_COUNT; j++ ) {
+      if( strcmp(type_names[j].name, json_string_value(type)) == 0 ) {
+        return type_names[j].mask;
+      }
+    }
+    return -1;
+  }
+  if( !json_is_array(type) ) {
+    return -1;
+  }
+  json_array_foreach(type, i, name) {
+    int bits;
+    if( !json_is_string(name) || (bits = type_mask(name)) < 0 ) {
+      return -1;
+    }
+    mask |= bits;
+  }
+  return mask;
+}
+
+static
+int limit_op(const char *keyword) {
+  size_t i;
+
+  for( i = 0; i < sizeof(limits) / sizeof(*limits); i++ ) {
+    if( strcmp(limits[i].keyword, keyword) == 0 ) {
+      return limits[i].op;
+    }
+  }
+  return OP_END;
+}
+
+static
+int is_count(json_t *value) {
+  return json_is_integer(value) && json_integer_value(value) >= 0;
+}
+
+static
+int is_annotation(const char *keyword) {
+  static const char *annotations[] = {
+    "$schema", "$id", "$comment", "title", "description",
+    "default", "examples", "deprecated", "readOnly", "writeOnly"
+  };
+  size_t i;
+
+  for( i = 0; i < sizeof(annotations) / sizeof(*annotations); i++ ) {
+    if( strcmp(annotations[i], keyword) == 0 ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Emits the checks of one schema, leaving its subschemas pending */
+static
+int compile_checks(schema_compiler *c, json_t *schema) {
+  const char *keyword;
+  json_t *value, *element, *properties;
+  schema_op *op;
+  size_t i;
+  int first, kind, mask;
+
+  if( json_is_true(schema) ) {
+    return 0;
+  }
+  if( json_is_false(schema) ) {
+    return emit(c, OP_FAIL, NULL) != NULL ? 0 : -1;
+  }
+  if( !json_is_object(schema) ) {
+    return -1;
+  }
+
+  /* additionalProperties follows the property checks it skips */
+  first = c->count;
+  if( (properties = json_object_get(schema, "properties")) != NULL ) {
+    if( !json_is_object(properties) ) {
+      return -1;
+    }
+    json_object_foreach(properties, keyword, value) {
+      if( (op = emit(c, OP_PROPERTY, value)) == NULL ) {
+        return -1;
+      }
+      op->arg.key = keyword;
+    }
+  }
+  if( (value = json_object_get(schema, "additionalProperties")) != NULL ) {
+    if( (op = emit(c, OP_ADDITIONAL, value)) == NULL ) {
+      return -1;
+    }
+    op->n = c->count - 1 - first;
+  }
+
+  json_object_foreach(schema, keyword, value) {
+    if( strcmp(keyword, "type") == 0 ) {
+      if( (mask = type_mask(value)) < 0 ||
+          (op = emit(c, OP_TYPE, NULL)) == NULL ) {
+        return -1;
+      }
+      op->n = mask;
+    } else if( strcmp(keyword, "enum") == 0 ||
+               strcmp(keyword, "const") == 0 ) {
+      kind = keyword[0] == 'e' ? OP_ENUM : OP_CONST;
+      if( (kind == OP_ENUM && !json_is_array(value)) ||
+          (op = emit(c, kind, NULL)) == NULL ) {
+        return -1;
+      }
+      op->arg.value = value;
+    } else if( (kind = limit_op(keyword)) != OP_END ) {
+      if( kind <= OP_MAX_ITEMS ? !is_count(value) : !json_is_number(value) ) {
+        return -1;
+      }
+      if( (op = emit(c, kind, NULL)) == NULL ) {
+        return -1;
+      }
+      op->n = kind <= OP_MAX_ITEMS ? (size_t) json_integer_value(value) : 0;
+      op->arg.number = json_number_value(value);
+    } else if( strcmp(keyword, "prefixItems") == 0 ||
+               (strcmp(keyword, "items") == 0 && json_is_array(value)) ) {
+      /* Positional schemas; the array form of items is the older
+         spelling of prefixItems */
+      if( !json_is_array(value) ) {
+        return -1;
+      }
+      json_array_foreach(value, i, element) {
+        if( (op = emit(c, OP_ITEM, element)) == NULL ) {
+          return -1;
+        }
+        op->n = i;
+      }
+    } else if( strcmp(keyword, "items") == 0 ) {
+      if( (op = emit(c, OP_ITEMS, value)) == NULL ) {
+        return -1;
+      }
+      /* Elements after the positional ones */
+      element = json_object_get(schema, "prefixItems");
+      op->n = json_is_array(element) ? json_array_size(element) : 0;
+    } else if( strcmp(keyword, "required") == 0 ) {
+      if( !json_is_array(value) ) {
+        return -1;
+      }
+      json_array_foreach(value, i, element) {
+        if( !json_is_string(element) ||
+            (op = emit(c, OP_REQUIRED, NULL)) == NULL ) {
+          return -1;
+        }
+        op->arg.key = json_string_value(element);
+      }
+    } else if( strcmp(keyword, "properties") != 0 &&
+               strcmp(keyword, "additionalProperties") != 0 &&
+               !is_annotation(keyword) ) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Compiles a schema and its subschemas, returning the index of its
+   first check */
+static
+int compile(schema_compiler *c, json_t *schema) {
+  int start = c->count, end, i, child;
+
+  if( compile_checks(c, schema) != 0 || emit(c, OP_END, NULL) == NULL ) {
+    return -1;
+  }
+  end = c->count;
+  for( i = start; i < end; i++ ) {
+    if( c->pending[i] != NULL ) {
+      if( (child = compile(c, c->pending[i])) < 0 ) {
+        return -1;
+      }
+      c->ops[i].child = child;
+      c->pending[i] = NULL;
+    }
+  }
+  return start;
+}
+
+jrpc_schema* jrpc_schema_compile(json_t *schema) {
+  schema_compiler c = { NULL, NULL, 0, 0 };
+  jrpc_schema *compiled = NULL;
+  json_t *source;
+
+  if( (source = json_deep_copy(schema)) == NULL ) {
+    return NULL;
+  }
+  if( compile(&c, source) == 0 &&
+      (compiled = malloc(sizeof(jrpc_schema) +
+                         c.count * sizeof(schema_op))) != NULL ) {
+    compiled->source = source;
+    compiled->count = c.count;
+    memcpy(compiled->ops, c.ops, c.count * sizeof(schema_op));
+  } else {
+    json_decref(source);
+  }
+  free(c.ops);
+  free(c.pending);
+  return compiled;
+}
+
+void jrpc_schema_free(jrpc_schema *schema) {
+  if( schema != NULL ) {
+    json_decref(schema->source);
+    free(schema);
+  }
+}
+
+//
+// Checking
+//
+
+static
+int value_type(json_t *value) {
+  double number;
+
+  switch( json_typeof(value) ) {
+  case JSON_NULL: return TYPE_NULL;
+  case JSON_TRUE:
+  case JSON_FALSE: return TYPE_BOOLEAN;
+  case JSON_INTEGER: return TYPE_INTEGER;
+  case JSON_REAL:
+    /* 1.0 is an integer too, as is every double from 2^52 up */
+    number = json_real_value(value);
+    return number >= 4503599627370496.0 || number <= -4503599627370496.0 ||
+      number == (double) (long long) number ? TYPE_INTEGER | TYPE_NUMBER
+                                            : TYPE_NUMBER;
+  case JSON_STRING: return TYPE_STRING;
+  case JSON_ARRAY: return TYPE_ARRAY;
+  default: return TYPE_OBJECT;
+  }
+}
+
+/* Characters, not bytes: UTF-8 continuation bytes are not counted */
+static
+size_t string_length(json_t *value) {
+  const unsigned char *s = (const unsigned char*) json_string_value(value);
+  size_t i, len = json_string_length(value), count = 0;
+
+  for( i = 0; i < len; i++ ) {
+    count += (s[i] & 0xc0) != 0x80;
+  }
+  return count;
+}
+
+static
+void type_names_of(int mask, char *out, size_t size) {
+  size_t i, len = 0;
+
+  out[0] = '\0';
+  for( i = 0; i < TYPE_COUNT && len < size; i++ ) {
+    /* "number" covers "integer" */
+    if( (mask & type_names[i].mask) == type_names[i].mask &&
+        !(type_names[i].mask == TYPE_INTEGER && (mask & TYPE_NUMBER)) ) {
+      len += snprintf(out + len, size - len, "%s%s",
+                      len > 0 ? " or " : "", type_names[i].name);
+    }
+  }
+}
+
+static
+void append(schema_error *error, size_t *len, const char *s, size_t n) {
+  if( n > sizeof(error->path) - 1 - *len ) {
+    n = sizeof(error->path) - 1 - *len;
+  }
+  memcpy(error->path + *len, s, n);
+  *len += n;
+  error->path[*len] = '\0';
+}
+
+/* Appends the JSON Pointer of path, relative to params */
+static
+void format_path(schema_error *error, size_t *len, const schema_path *path) {
+  char index[24];
+  const char *c;
+
+  if( path == NULL || path->parent == NULL ) {
+    return;
+  }
+  format_path(error, len, path->parent);
+  if( path->key == NULL ) {
+    append(error, len, index,
+           snprintf(index, sizeof(index), "/%zu", path->index));
+    return;
+  }
+  append(error, len, "/", 1);
+  for( c = path->key; *c != '\0'; c++ ) {
+    /* ~ and / are escaped as ~0 and ~1 */
+    if( *c == '~' ) {
+      append(error, len, "~0", 2);
+    } else if( *c == '/' ) {
+      append(error, len, "~1", 2);
+    } else {
+      append(error, len, c, 1);
+    }
+  }
+}
+
+static
+int fail(schema_error *error,
+         const schema_path *path,
+         const char *fmt, ...) {
+  va_list args;
+  size_t len = 0;
+
+  error->path[0] = '\0';
+  format_path(error, &len, path);
+  va_start(args, fmt);
+  vsnprintf(error->reason, sizeof(error->reason), fmt, args);
+  va_end(args);
+  return -1;
+}
+
+static
+int run(const jrpc_schema *schema,
+        int pc,
+        json_t *value,
+        const schema_path *path,
+        schema_error *error) {
+  const schema_op *op, *property;
+  schema_path step;
+  const char *key;
+  json_t *element;
+  size_t i, n;
+  char names[64];
+  int type = value_type(value);
+
+  for( op = &schema->ops[pc]; op->op != OP_END; op++ ) {
+    step.parent = path;
+    step.key = NULL;
+    switch( op->op ) {
+    case OP_FAIL:
+      return fail(error, path, "not allowed");
+    case OP_TYPE:
+      if( (type & op->n) == 0 ) {
+        type_names_of(op->n, names, sizeof(names));
+        return fail(error, path, "expected %s", names);
+      }
+      break;
+    case OP_ENUM:
+      json_array_foreach(op->arg.value, i, element) {
+        if( json_equal(value, element) ) {
+          break;
+        }
+      }
+      if( i == json_array_size(op->arg.value) ) {
+        return fail(error, path, "not one of the allowed values");
+      }
+      break;
+    case OP_CONST:
+      if( !json_equal(value, op->arg.value) ) {
+        return fail(error, path, "not the allowed value");
+      }
+      break;
+    case OP_MIN_LENGTH:
+      if( type == TYPE_STRING && string_length(value) < op->n ) {
+        return fail(error, path, "shorter than %zu characters", op->n);
+      }
+      break;
+    case OP_MAX_LENGTH:
+      if( type == TYPE_STRING && string_length(value) > op->n ) {
+        return fail(error, path, "longer than %zu characters", op->n);
+      }
+      break;
+    case OP_MINIMUM:
+      if( (type & (TYPE_INTEGER | TYPE_NUMBER)) &&
+          json_number_value(value) < op->arg.number ) {
+        return fail(error, path, "less than %g", op->arg.number);
+      }
+      break;
+    case OP_MAXIMUM:
+      if( (type & (TYPE_INTEGER | TYPE_NUMBER)) &&
+          json_number_value(value) > op->arg.number ) {
+        return fail(error, path, "greater than %g", op->arg.number);
+      }
+      break;
+    case OP_EXCLUSIVE_MINIMUM:
+      if( (type & (TYPE_INTEGER | TYPE_NUMBER)) &&
+          json_number_value(value) <= op->arg.number ) {
+        return fail(error, path, "not greater than %g", op->arg.number);
+      }
+      break;
+    case OP_EXCLUSIVE_MAXIMUM:
+      if( (type & (TYPE_INTEGER | TYPE_NUMBER)) &&
+          json_number_value(value) >= op->arg.number ) {
+        return fail(error, path, "not less than %g", op->arg.number);
+      }
+      break;
+    case OP_MIN_ITEMS:
+      if( type == TYPE_ARRAY && json_array_size(value) < op->n ) {
+        return fail(error, path, "fewer than %zu elements", op->n);
+      }
+      break;
+    case OP_MAX_ITEMS:
+      if( type == TYPE_ARRAY && json_array_size(value) > op->n ) {
+        return fail(error, path, "more than %zu elements", op->n);
+      }
+      break;
+    case OP_ITEM:
+      if( type == TYPE_ARRAY &&
+          (element = json_array_get(value, op->n)) != NULL ) {
+        step.index = op->n;
+        if( run(schema, op->child, element, &step, error) != 0 ) {
+          return -1;
+        }
+      }
+      break;
+    case OP_ITEMS:
+      if( type == TYPE_ARRAY ) {
+        n = json_array_size(value);
+        for( i = op->n; i < n; i++ ) {
+          step.index = i;
+          if( run(schema, op->child, json_array_get(value, i),
+                  &step, error) != 0 ) {
+            return -1;
+          }
+        }
+      }
+      break;
+    case OP_PROPERTY:
+      if( type == TYPE_OBJECT &&
+          (element = json_object_get(value, op->arg.key)) != NULL ) {
+        step.key = op->arg.key;
+        if( run(schema, op->child, element, &step, error) != 0 ) {
+          return -1;
+        }
+      }
+      break;
+    case OP_REQUIRED:
+      if( type == TYPE_OBJECT && json_object_get(value, op->arg.key) == NULL ) {
+        step.key = op->arg.key;
+        return fail(error, &step, "missing");
+      }
+      break;
+    case OP_ADDITIONAL:
+      if( type != TYPE_OBJECT ) {
+        break;
+      }
+      json_object_foreach(value, key, element) {
+        for( property = op - op->n; property < op; property++ ) {
+          if( strcmp(property->arg.key, key) == 0 ) {
+            break;
+          }
+        }
+        if( property == op ) {
+          step.key = key;
+          if( run(schema, op->child, element, &step, error) != 0 ) {
+            return -1;
+          }
+        }
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+int jrpc_schema_check(const jrpc_schema *schema,
+                      json_t *params,
+                      jrpc_context *ctx) {
+  schema_path root = { NULL, NULL, 0 };
+  schema_error error;
+  size_t len;
+
+  if( schema == NULL ) {
+    return 0;
+  }
+  /* Omitted params are checked as null */
+  if( run(schema, 0, params != NULL ? params : json_null(),
+          &root, &error) == 0 ) {
+    return 0;
+  }
+  len = strlen(error.path) + strlen(error.reason) + 32;
+  if( (ctx->error_msg = malloc(len)) != NULL ) {
+    snprintf(ctx->error_msg, len, "Invalid params%s%s: %s",
+             error.path[0] != '\0' ? " at " : "", error.path, error.reason);
+  }
+  ctx->error_code = JRPC_INVALID_PARAMS;
+  ctx->error_data = json_pack("{s:s}", "path", error.path);
+  return -1;
+}
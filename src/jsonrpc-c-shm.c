@@ -0,0 +1,913 @@
+/*
+ * jsonrpc-c-shm.c
+ *
+ *  Shared-memory transport for clients on the same host.
+ *
+ *  A client connects to the server's Unix socket and receives three
+ *  descriptors: a memfd holding two single-producer/single-consumer
+ *  byte rings, and two eventfds, one to wake each side. The socket
+ *  stays open only to tell either side that the other went away.
+ *
+ *  The rings carry newline separated JSON exactly like a raw TCP
+ *  connection, so requests go through jrpc_connection_feed and
+ *  responses through the connection's output queue. A side that runs
+ *  out of work spins for a while before it sleeps on its eventfd, and
+ *  the peer only writes the eventfd when the flag in the ring says it
+ *  is asleep. The spin window adapts: it grows to cover the gaps in
+ *  which work did arrive and shrinks whenever it runs out.
+ *
+ *  The mapping is writable by the peer, so each side keeps its own
+ *  ring size and counters privately and reads the peer's counters
+ *  once per use; a counter that puts the ring out of range ends the
+ *  connection. The server seals the memfd's size.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "jsonrpc-c-internal.h"
+
+#ifdef HAVE_MEMFD_CREATE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define SHM_MAGIC 0x6a727063
+#define SHM_VERSION 1
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_DATA_OFFSET 4096
+
+// bounds of the spin window, in seconds
+#define SHM_SPIN_MIN 0.000002
+#define SHM_SPIN_START 0.00005
+#define SHM_SPIN_MAX 0.0002
+
+// Control block of one ring. head and tail are free running byte
+// counters, each written by one side only and kept on its own line.
+typedef struct {
+  uint64_t head;
+  char pad0[56];
+  uint64_t tail;
+  char pad1[56];
+  uint32_t consumer_sleeping;
+  uint32_t producer_blocked;
+  char pad2[56];
+} shm_ring;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_size;
+  char pad[48];
+  // 0: client to server, 1: server to client
+  shm_ring rings[2];
+} shm_header;
+
+// One side's view of a ring
+typedef struct {
+  shm_ring *ring;
+  char *data;
+  size_t size;
+  // our counter: head of a ring we write, tail of one we read. The
+  // shared copy is only ever stored to.
+  uint64_t pos;
+  // the peer's counter was out of range
+  int broken;
+  // eventfd of the other side
+  int wake_fd;
+} shm_channel;
+
+typedef struct {
+  void *map;
+  size_t map_size;
+  shm_channel rx;
+  shm_channel tx;
+  int event_fd;
+  int peer_fd;
+  struct ev_io event_watcher;
+  struct ev_idle spin_watcher;
+  ev_tstamp spin_start;
+  ev_tstamp spin_window;
+  ev_tstamp spin_max;
+} shm_conn;
+
+struct jrpc_shm_client {
+  int sock;
+  int event_fd;
+  int peer_fd;
+  void *map;
+  size_t map_size;
+  shm_channel tx;
+  shm_channel rx;
+  // received bytes not yet returned as a message
+  char *buffer;
+  size_t len;
+  size_t size;
+  ev_tstamp spin_window;
+  ev_tstamp spin_max;
+};
+
+//
+// Rings
+//
+
+/* size is our own copy of the ring size; the one in the header is
+   the peer's to overwrite */
+static
+void channel_init(shm_channel *ch,
+                  void *map,
+                  size_t size,
+                  int index,
+                  int wake_fd) {
+  shm_header *header = (shm_header*) map;
+  ch->ring = &header->rings[index];
+  ch->size = size;
+  ch->data = (char*) map + SHM_DATA_OFFSET + index * ch->size;
+  ch->pos = 0;
+  ch->broken = 0;
+  ch->wake_fd = wake_fd;
+}
+
+/* Consumer side. The producer's head is loaded once, and must be
+   within one ring of our tail. */
+static
+size_t channel_available(shm_channel *ch) {
+  uint64_t head = __atomic_load_n(&ch->ring->head, __ATOMIC_ACQUIRE);
+
+  if( head - ch->pos > ch->size ) {
+    ch->broken = 1;
+    return 0;
+  }
+  return head - ch->pos;
+}
+
+/* Producer side, likewise for the consumer's tail */
+static
+size_t channel_room(shm_channel *ch) {
+  uint64_t tail = __atomic_load_n(&ch->ring->tail, __ATOMIC_ACQUIRE);
+
+  if( ch->pos - tail > ch->size ) {
+    ch->broken = 1;
+    return 0;
+  }
+  return ch->size - (ch->pos - tail);
+}
+
+/* Producer side. Returns the number of bytes that fit. */
+static
+size_t channel_write(shm_channel *ch, const char *data, size_t len) {
+  size_t room = channel_room(ch), offset, n;
+
+  if( len > room ) {
+    len = room;
+  }
+  offset = ch->pos & (ch->size - 1);
+  n = ch->size - offset < len ? ch->size - offset : len;
+  memcpy(ch->data + offset, data, n);
+  memcpy(ch->data, data + n, len - n);
+  ch->pos += len;
+  __atomic_store_n(&ch->ring->head, ch->pos, __ATOMIC_RELEASE);
+  return len;
+}
+
+/* Consumer side: the readable bytes up to the end of the ring */
+static
+size_t channel_peek(shm_channel *ch, const char **data) {
+  size_t available = channel_available(ch);
+  size_t offset = ch->pos & (ch->size - 1);
+
+  *data = ch->data + offset;
+  return available < ch->size - offset ? available : ch->size - offset;
+}
+
+static
+void channel_release(shm_channel *ch, size_t len) {
+  ch->pos += len;
+  __atomic_store_n(&ch->ring->tail, ch->pos, __ATOMIC_RELEASE);
+}
+
+/* The fences pair with the ones in channel_sleep and channel_block:
+   either the sleeper sees the new bytes or we see its flag. */
+static
+void channel_wake_consumer(shm_channel *ch) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if( __atomic_load_n(&ch->ring->consumer_sleeping, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&ch->ring->consumer_sleeping, 0,
+                          __ATOMIC_ACQ_REL) ) {
+    eventfd_write(ch->wake_fd, 1);
+  }
+}
+
+static
+void channel_wake_producer(shm_channel *ch) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if( __atomic_load_n(&ch->ring->producer_blocked, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&ch->ring->producer_blocked, 0,
+                          __ATOMIC_ACQ_REL) ) {
+    eventfd_write(ch->wake_fd, 1);
+  }
+}
+
+/* Returns 1 if the consumer may sleep, 0 if bytes arrived meanwhile */
+static
+int channel_sleep(shm_channel *ch) {
+  __atomic_store_n(&ch->ring->consumer_sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if( channel_available(ch) > 0 ) {
+    __atomic_store_n(&ch->ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+/* Returns 1 if the producer may sleep, 0 if room appeared meanwhile */
+static
+int channel_block(shm_channel *ch) {
+  __atomic_store_n(&ch->ring->producer_blocked, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if( channel_room(ch) > 0 ) {
+    __atomic_store_n(&ch->ring->producer_blocked, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+//
+// Spinning
+//
+
+/* Spinning only helps when the peer runs on another CPU */
+static
+ev_tstamp spin_max(void) {
+  return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_MAX : 0;
+}
+
+/* Grows the window to twice the gap after which work arrived, or
+   halves it when the whole window passed without any */
+static
+ev_tstamp spin_adapt(ev_tstamp window, ev_tstamp gap, int found,
+                     ev_tstamp max) {
+  if( found ) {
+    window = gap * 2 > window ? gap * 2 : window;
+  } else {
+    window = window / 2 > SHM_SPIN_MIN ? window / 2 : SHM_SPIN_MIN;
+  }
+  return window < max ? window : max;
+}
+
+//
+// Server
+//
+
+/* Closes a connection whose client put a ring out of range. Returns
+   -1 if it did. The caller releases the connection. */
+static
+int shm_check(jrpc_connection *conn) {
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+
+  if( !sc->rx.broken && !sc->tx.broken ) {
+    return 0;
+  }
+  if( !conn->closing ) {
+#ifdef DEBUG
+    jrpc_set_error(conn->server, -1, "shm", "ring index out of range");
+#endif
+    conn->refs++;
+    jrpc_connection_close(conn);
+    conn->refs--;
+  }
+  return -1;
+}
+
+/* Evaluates the requests in the client's ring. Returns 1 if there
+   were any. The caller releases the connection. */
+static
+int shm_poll(jrpc_connection *conn) {
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+  const char *data;
+  size_t len;
+  int found = 0;
+
+  /* Input waits while a result is streamed, as on a socket */
+  while( !conn->closing && conn->stream == NULL &&
+         (len = channel_peek(&sc->rx, &data)) > 0 ) {
+    found = 1;
+    conn->refs++;
+    jrpc_connection_feed(conn, data, len);
+    conn->refs--;
+    channel_release(&sc->rx, len);
+    channel_wake_producer(&sc->rx);
+  }
+  shm_check(conn);
+  return found;
+}
+
+static
+void shm_spin(jrpc_connection *conn) {
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+  __atomic_store_n(&sc->rx.ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+  sc->spin_start = ev_time();
+  ev_idle_start(conn->server->loop, &sc->spin_watcher);
+}
+
+static
+void shm_event_cb(struct ev_loop *loop,
+                  struct ev_io *w,
+                  int revents) {
+  jrpc_connection *conn = (jrpc_connection*) w->data;
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+  eventfd_t value;
+
+  eventfd_read(sc->event_fd, &value);
+  if( conn->out_head != NULL ) {
+    /* Woken for room in the response ring */
+    jrpc_connection_dirty(conn);
+  }
+  shm_poll(conn);
+  if( !conn->closing && !ev_is_active(&sc->spin_watcher) ) {
+    shm_spin(conn);
+  }
+  jrpc_connection_release(conn);
+}
+
+static
+void shm_spin_cb(struct ev_loop *loop,
+                 struct ev_idle *w,
+                 int revents) {
+  jrpc_connection *conn = (jrpc_connection*) w->data;
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+  ev_tstamp now = ev_time(), gap = now - sc->spin_start;
+
+  if( shm_poll(conn) ) {
+    sc->spin_window = spin_adapt(sc->spin_window, gap, 1, sc->spin_max);
+    sc->spin_start = now;
+  } else if( conn->stream != NULL ) {
+    /* Resumed by jrpc_shm_flush once the stream ends */
+    ev_idle_stop(loop, w);
+  } else if( gap >= sc->spin_window ) {
+    sc->spin_window = spin_adapt(sc->spin_window, gap, 0, sc->spin_max);
+    if( channel_sleep(&sc->rx) ) {
+      ev_idle_stop(loop, w);
+    } else {
+      sc->spin_start = now;
+    }
+  }
+  jrpc_connection_release(conn);
+}
+
+static
+void shm_control_cb(struct ev_loop *loop,
+                    struct ev_io *w,
+                    int revents) {
+  jrpc_connection *conn = (jrpc_connection*) w;
+  char buf[64];
+  ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+
+  /* The client never writes here, only hangs up */
+  if( n == 0 ||
+      (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+    jrpc_connection_close(conn);
+  }
+}
+
+static
+size_t ring_size(jrpc_server *server) {
+  size_t wanted = server->shm_ring_size > 0 ?
+    server->shm_ring_size : SHM_RING_SIZE;
+  size_t size = 4096;
+  while( size < wanted ) {
+    size <<= 1;
+  }
+  return size;
+}
+
+static
+int send_fds(int sock, int *fds, int count) {
+  char cmsg_buf[CMSG_SPACE(3 * sizeof(int))];
+  char byte = 0;
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cmsg_buf, 0, sizeof(cmsg_buf));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* Maps the rings of a new connection and hands them to the client */
+static
+int shm_setup(jrpc_connection *conn) {
+  jrpc_server *server = conn->server;
+  size_t size = ring_size(server);
+  shm_header *header;
+  shm_conn *sc;
+  int fds[3], result;
+
+  if( (sc = calloc(1, sizeof(shm_conn))) == NULL ) {
+    return -1;
+  }
+  sc->event_fd = sc->peer_fd = -1;
+  conn->backend_data = sc;
+
+  sc->map_size = SHM_DATA_OFFSET + 2 * size;
+  if( (fds[0] = memfd_create("jsonrpc-c",
+                             MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ) {
+    return -1;
+  }
+  /* Sealed so the client cannot truncate the mapping under us */
+  if( ftruncate(fds[0], sc->map_size) != 0 ||
+      fcntl(fds[0], F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+      (sc->map = mmap(NULL, sc->map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fds[0], 0)) == MAP_FAILED ) {
+    sc->map = NULL;
+    close(fds[0]);
+    return -1;
+  }
+  header = (shm_header*) sc->map;
+  header->magic = SHM_MAGIC;
+  header->version = SHM_VERSION;
+  header->ring_size = size;
+  /* Until the first request the server sleeps */
+  header->rings[0].consumer_sleeping = 1;
+
+  sc->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  sc->peer_fd = eventfd(0, EFD_CLOEXEC);
+  if( sc->event_fd < 0 || sc->peer_fd < 0 ) {
+    close(fds[0]);
+    return -1;
+  }
+  fds[1] = sc->event_fd;
+  fds[2] = sc->peer_fd;
+  result = send_fds(conn->fd, fds, 3);
+  close(fds[0]);
+  if( result != 0 ) {
+    return -1;
+  }
+
+  channel_init(&sc->rx, sc->map, size, 0, sc->peer_fd);
+  channel_init(&sc->tx, sc->map, size, 1, sc->peer_fd);
+  sc->spin_max = spin_max();
+  sc->spin_window = spin_adapt(SHM_SPIN_START, 0, 1, sc->spin_max);
+  ev_io_init(&sc->event_watcher, shm_event_cb, sc->event_fd, EV_READ);
+  sc->event_watcher.data = conn;
+  ev_idle_init(&sc->spin_watcher, shm_spin_cb);
+  sc->spin_watcher.data = conn;
+  ev_io_start(server->loop, &sc->event_watcher);
+  return 0;
+}
+
+static
+void shm_accept_cb(struct ev_loop *loop,
+                   struct ev_io *w,
+                   int revents) {
+  jrpc_server *server = (jrpc_server*) w->data;
+  jrpc_connection *conn;
+  int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if( fd == -1 ) {
+#ifdef DEBUG
+    jrpc_set_error(server, errno, "accept", NULL);
+#endif
+    return;
+  }
+  if( (conn = jrpc_connection_new(server, fd)) == NULL ) {
+    close(fd);
+    return;
+  }
+  conn->protocol = JRPC_PROTOCOL_SHM;
+  if( shm_setup(conn) != 0 ) {
+#ifdef DEBUG
+    jrpc_set_error(server, errno, "shm_setup", NULL);
+#endif
+    jrpc_connection_free(conn);
+    return;
+  }
+  ev_io_init(&conn->io, shm_control_cb, fd, EV_READ);
+  ev_io_start(loop, &conn->io);
+}
+
+int jrpc_shm_start(jrpc_server *server) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if( (fd = jrpc_handover_fd(server, 1)) >= 0 ) {
+    goto listening;
+  }
+  if( strlen(server->shm_path) >= sizeof(addr.sun_path) ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, server->shm_path);
+  unlink(server->shm_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if( fd == -1 ) {
+    return -1;
+  }
+  if( bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      listen(fd, server->listener.backlog) == -1 ) {
+    close(fd);
+    return -1;
+  }
+
+ listening:
+  ev_io_init(&server->shm_watcher, shm_accept_cb, fd, EV_READ);
+  server->shm_watcher.data = server;
+  ev_io_start(server->loop, &server->shm_watcher);
+  return 0;
+}
+
+void jrpc_shm_destroy(jrpc_server *server) {
+  if( server->shm_path == NULL ) {
+    return;
+  }
+  if( ev_is_active(&server->shm_watcher) ) {
+    ev_io_stop(server->loop, &server->shm_watcher);
+    close(server->shm_watcher.fd);
+    unlink(server->shm_path);
+  }
+  free(server->shm_path);
+  server->shm_path = NULL;
+}
+
+void jrpc_shm_flush(jrpc_connection *conn) {
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+  jrpc_output *out;
+  size_t written = 0, left, n;
+
+  if( conn->closing ) {
+    jrpc_connection_drop_output(conn);
+    return;
+  }
+
+  while( (out = conn->out_head) != NULL ) {
+    left = out->len - conn->out_offset;
+    n = channel_write(&sc->tx, out->data + conn->out_offset, left);
+    written += n;
+    jrpc_connection_consume(conn, n);
+    if( n < left && channel_block(&sc->tx) ) {
+      /* The client's eventfd write brings us back */
+      break;
+    }
+  }
+  if( written > 0 ) {
+    channel_wake_consumer(&sc->tx);
+  }
+  if( shm_check(conn) != 0 ) {
+    return;
+  }
+
+  /* Polling stops while a result is streamed */
+  if( conn->stream == NULL && !ev_is_active(&sc->spin_watcher) &&
+      !channel_sleep(&sc->rx) ) {
+    shm_spin(conn);
+  }
+}
+
+void jrpc_shm_close(jrpc_connection *conn) {
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+
+  ev_io_stop(conn->server->loop, &sc->event_watcher);
+  ev_idle_stop(conn->server->loop, &sc->spin_watcher);
+  jrpc_connection_drop_output(conn);
+}
+
+int jrpc_shm_pending(jrpc_connection *conn) {
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+  return sc != NULL && channel_available(&sc->rx) > 0;
+}
+
+void jrpc_shm_free(jrpc_connection *conn) {
+  shm_conn *sc = (shm_conn*) conn->backend_data;
+
+  if( sc == NULL ) {
+    return;
+  }
+  if( sc->map != NULL ) {
+    munmap(sc->map, sc->map_size);
+  }
+  if( sc->event_fd >= 0 ) {
+    close(sc->event_fd);
+  }
+  if( sc->peer_fd >= 0 ) {
+    close(sc->peer_fd);
+  }
+  free(sc);
+  conn->backend_data = NULL;
+}
+
+//
+// Client
+//
+
+static
+int receive_fds(int sock, int *fds, int count) {
+  char cmsg_buf[CMSG_SPACE(3 * sizeof(int))];
+  char byte;
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+  if( recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+      (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(count * sizeof(int)) ) {
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+  return 0;
+}
+
+jrpc_shm_client* jrpc_shm_connect(const char *path) {
+  jrpc_shm_client *client;
+  struct sockaddr_un addr;
+  struct stat st;
+  shm_header *header;
+  size_t size;
+  int fds[3];
+
+  if( strlen(path) >= sizeof(addr.sun_path) ||
+      (client = calloc(1, sizeof(jrpc_shm_client))) == NULL ) {
+    return NULL;
+  }
+  client->event_fd = client->peer_fd = -1;
+  client->spin_max = spin_max();
+  client->spin_window = spin_adapt(SHM_SPIN_START, 0, 1, client->spin_max);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if( (client->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ) {
+    free(client);
+    return NULL;
+  }
+  if( connect(client->sock, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+      receive_fds(client->sock, fds, 3) != 0 ) {
+    jrpc_shm_disconnect(client);
+    return NULL;
+  }
+  client->event_fd = fds[1];
+  client->peer_fd = fds[2];
+
+  if( fstat(fds[0], &st) != 0 || st.st_size < SHM_DATA_OFFSET ||
+      (client->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fds[0], 0)) == MAP_FAILED ) {
+    client->map = NULL;
+    close(fds[0]);
+    jrpc_shm_disconnect(client);
+    return NULL;
+  }
+  close(fds[0]);
+  client->map_size = st.st_size;
+
+  header = (shm_header*) client->map;
+  size = header->ring_size;
+  if( header->magic != SHM_MAGIC || header->version != SHM_VERSION ||
+      size == 0 || (size & (size - 1)) != 0 ||
+      SHM_DATA_OFFSET + 2 * size != client->map_size ) {
+    jrpc_shm_disconnect(client);
+    return NULL;
+  }
+  channel_init(&client->tx, client->map, size, 0, client->event_fd);
+  channel_init(&client->rx, client->map, size, 1, client->event_fd);
+  return client;
+}
+
+void jrpc_shm_disconnect(jrpc_shm_client *client) {
+  if( client->map != NULL ) {
+    munmap(client->map, client->map_size);
+  }
+  if( client->event_fd >= 0 ) {
+    close(client->event_fd);
+  }
+  if( client->peer_fd >= 0 ) {
+    close(client->peer_fd);
+  }
+  close(client->sock);
+  free(client->buffer);
+  free(client);
+}
+
+/* Sleeps until the server writes our eventfd. Returns -1 once the
+   server has hung up. */
+static
+int client_wait(jrpc_shm_client *client) {
+  struct pollfd fds[2];
+  eventfd_t value;
+
+  fds[0].fd = client->peer_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = client->sock;
+  fds[1].events = POLLIN;
+  while( poll(fds, 2, -1) < 0 ) {
+    if( errno != EINTR ) {
+      return -1;
+    }
+  }
+  if( fds[0].revents & POLLIN ) {
+    eventfd_read(client->peer_fd, &value);
+    return 0;
+  }
+  return -1;
+}
+
+static
+int client_write(jrpc_shm_client *client, const char *data, size_t len) {
+  size_t n;
+
+  while( len > 0 ) {
+    n = channel_write(&client->tx, data, len);
+    if( client->tx.broken ) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+    if( n == 0 ) {
+      channel_wake_consumer(&client->tx);
+      if( channel_block(&client->tx) && client_wait(client) != 0 ) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int jrpc_shm_send(jrpc_shm_client *client,
+                  const char *request,
+                  size_t len) {
+  if( client_write(client, request, len) != 0 ||
+      client_write(client, "\n", 1) != 0 ) {
+    return -1;
+  }
+  channel_wake_consumer(&client->tx);
+  return 0;
+}
+
+/* Moves the server's output into the client buffer. Returns the
+   number of bytes moved, -1 on allocation failure or if the server
+   put the ring out of range. */
+static
+ssize_t client_pull(jrpc_shm_client *client) {
+  const char *data;
+  size_t len, moved = 0;
+  char *buffer;
+
+  while( (len = channel_peek(&client->rx, &data)) > 0 ) {
+    if( client->len + len + 1 > client->size ) {
+      size_t size = client->size > 0 ? client->size : 4096;
+      while( size < client->len + len + 1 ) {
+        size *= 2;
+      }
+      if( (buffer = realloc(client->buffer, size)) == NULL ) {
+        return -1;
+      }
+      client->buffer = buffer;
+      client->size = size;
+    }
+    memcpy(client->buffer + client->len, data, len);
+    client->len += len;
+    moved += len;
+    channel_release(&client->rx, len);
+  }
+  if( moved > 0 ) {
+    channel_wake_producer(&client->rx);
+  }
+  return client->rx.broken ? -1 : (ssize_t) moved;
+}
+
+static
+char* client_line(jrpc_shm_client *client) {
+  char *eol, *line;
+  size_t len;
+
+  if( client->len == 0 ||
+      (eol = memchr(client->buffer, '\n', client->len)) == NULL ) {
+    return NULL;
+  }
+  len = eol - client->buffer;
+  if( (line = malloc(len + 1)) == NULL ) {
+    return NULL;
+  }
+  memcpy(line, client->buffer, len);
+  line[len] = '\0';
+  client->len -= len + 1;
+  memmove(client->buffer, eol + 1, client->len);
+  return line;
+}
+
+char* jrpc_shm_receive(jrpc_shm_client *client) {
+  ev_tstamp start = 0, now;
+  ssize_t moved;
+  char *line;
+
+  for(;;) {
+    if( (line = client_line(client)) != NULL ) {
+      return line;
+    }
+    if( (moved = client_pull(client)) < 0 ) {
+      return NULL;
+    }
+    now = ev_time();
+    if( moved > 0 ) {
+      if( start > 0 ) {
+        client->spin_window = spin_adapt(client->spin_window, now - start,
+                                         1, client->spin_max);
+      }
+      start = 0;
+    } else if( start == 0 ) {
+      start = now;
+    } else if( now - start >= client->spin_window ) {
+      client->spin_window = spin_adapt(client->spin_window, now - start,
+                                       0, client->spin_max);
+      if( channel_sleep(&client->rx) && client_wait(client) != 0 ) {
+        /* The server is gone, but may have answered before */
+        if( client_pull(client) <= 0 ) {
+          return NULL;
+        }
+      }
+      start = 0;
+    }
+  }
+}
+
+char* jrpc_shm_call(jrpc_shm_client *client,
+                    const char *request,
+                    size_t len) {
+  if( jrpc_shm_send(client, request, len) != 0 ) {
+    return NULL;
+  }
+  return jrpc_shm_receive(client);
+}
+
+#else
+
+int jrpc_shm_start(jrpc_server *server) {
+  errno = ENOSYS;
+  return -1;
+}
+
+void jrpc_shm_destroy(jrpc_server *server) {
+  free(server->shm_path);
+  server->shm_path = NULL;
+}
+
+void jrpc_shm_flush(jrpc_connection *conn) {
+}
+
+void jrpc_shm_close(jrpc_connection *conn) {
+}
+
+void jrpc_shm_free(jrpc_connection *conn) {
+}
+
+int jrpc_shm_pending(jrpc_connection *conn) {
+  return 0;
+}
+
+jrpc_shm_client* jrpc_shm_connect(const char *path) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+void jrpc_shm_disconnect(jrpc_shm_client *client) {
+}
+
+int jrpc_shm_send(jrpc_shm_client *client,
+                  const char *request,
+                  size_t len) {
+  return -1;
+}
+
+char* jrpc_shm_receive(jrpc_shm_client *client) {
+  return NULL;
+}
+
+char* jrpc_shm_call(jrpc_shm_client *client,
+                    const char *request,
+                    size_t len) {
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * jsonrpc-c-stream.c
+ *
+ *  Streamed results.
+ *
+ *  A streamed result is written into the connection's output queue
+ *  a chunk at a time while the queue is below the high-water mark,
+ *  so a huge result never exists in memory as a whole: neither as a
+ *  json_t tree nor as one serialized string.
+ */
+
+#include "jsonrpc-c-internal.h"
+
+#define STREAM_CHUNK 16384
+
+enum {
+  STREAM_EMPTY = 0,
+  STREAM_ARRAY,    // elements written with jrpc_stream_write
+  STREAM_RAW       // text written with jrpc_stream_write_raw
+};
+
+static
+size_t stream_size(jrpc_stream *stream) {
+  return stream->conn->out_bytes +
+    (stream->pending != NULL ? stream->pending->len : 0);
+}
+
+/* Queues the pending chunk in the connection's framing */
+static
+int stream_flush(jrpc_stream *stream) {
+  jrpc_buffer *buf = stream->pending, *compressed;
+  int result;
+
+  if( buf == NULL ) {
+    return 0;
+  }
+  stream->pending = NULL;
+  if( stream->chunked ) {
+    result = jrpc_http_queue_chunk(stream->conn, buf, buf->data, buf->len);
+  } else if( stream->conn->compress != NULL ) {
+    if( (compressed = jrpc_compress_buffer(stream->conn, buf, NULL)) == NULL ) {
+      result = -1;
+    } else {
+      result = jrpc_connection_queue(stream->conn, compressed,
+                                     compressed->data, compressed->len, 0);
+      jrpc_buffer_unref(compressed);
+    }
+  } else {
+    result = jrpc_connection_queue(stream->conn, buf, buf->data, buf->len, 0);
+  }
+  jrpc_buffer_unref(buf);
+  return result;
+}
+
+static
+int stream_append(jrpc_stream *stream, const char *data, size_t len) {
+  jrpc_buffer *buf;
+  size_t n;
+
+  while( len > 0 ) {
+    if( (buf = stream->pending) == NULL ) {
+      if( (buf = jrpc_buffer_new(NULL, STREAM_CHUNK)) == NULL ) {
+        return -1;
+      }
+      buf->len = 0;
+      stream->pending = buf;
+    }
+    n = STREAM_CHUNK - buf->len;
+    if( n > len ) {
+      n = len;
+    }
+    memcpy(buf->data + buf->len, data, n);
+    buf->len += n;
+    data += n;
+    len -= n;
+    if( buf->len == STREAM_CHUNK && stream_flush(stream) != 0 ) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static
+int dump_cb(const char *data, size_t len, void *stream) {
+  return stream_append((jrpc_stream*) stream, data, len);
+}
+
+static
+void stream_free(jrpc_stream *stream) {
+  stream->conn->stream = NULL;
+  jrpc_cancel_disarm(stream->conn);
+  if( stream->pending != NULL ) {
+    jrpc_buffer_unref(stream->pending);
+  }
+  free(stream);
+}
+
+/* Closes the result and the response around it */
+static
+int stream_end(jrpc_stream *stream) {
+  jrpc_connection *conn = stream->conn;
+  const char *tail;
+
+  switch( stream->mode ) {
+  case STREAM_ARRAY:
+    tail = "]}";
+    break;
+  case STREAM_RAW:
+    tail = "}";
+    break;
+  default:
+    tail = "[]}";
+    break;
+  }
+  if( stream_append(stream, tail, strlen(tail)) != 0 ||
+      (conn->protocol != JRPC_PROTOCOL_HTTP &&
+       stream_append(stream, "\n", 1) != 0) ||
+      stream_flush(stream) != 0 ) {
+    return -1;
+  }
+  if( conn->protocol == JRPC_PROTOCOL_HTTP ) {
+    return jrpc_http_stream_end(conn, stream->chunked);
+  }
+  return 0;
+}
+
+jrpc_stream* jrpc_stream_begin(jrpc_context *ctx,
+                               json_t *id,
+                               jrpc_stream_fn produce,
+                               void *data) {
+  jrpc_connection *conn = ctx->connection;
+  jrpc_server *server = conn->server;
+  jrpc_stream *stream;
+  char *id_text;
+  int result;
+
+  if( id == NULL || conn->closing || conn->stream != NULL ) {
+    return NULL;
+  }
+  if( (stream = calloc(1, sizeof(jrpc_stream))) == NULL ) {
+    return NULL;
+  }
+  if( (id_text = json_dumps(id, JSON_COMPACT | JSON_ENCODE_ANY)) == NULL ) {
+    free(stream);
+    return NULL;
+  }
+  stream->conn = conn;
+  stream->produce = produce;
+  stream->data = data;
+  stream->high_water = server->output_high_water > 0 ?
+    server->output_high_water : JRPC_STREAM_HIGH_WATER;
+
+  if( conn->protocol == JRPC_PROTOCOL_HTTP ) {
+    stream->chunked = jrpc_http_stream_begin(conn);
+  }
+  result = stream->chunked < 0 ||
+    stream_append(stream, "{\"jsonrpc\":\"2.0\",\"id\":", 22) != 0 ||
+    stream_append(stream, id_text, strlen(id_text)) != 0 ||
+    stream_append(stream, ",\"result\":", 10) != 0;
+  free(id_text);
+
+  conn->stream = stream;
+  conn->responded = 1;
+  if( result != 0 ) {
+    /* Part of the response may be queued already */
+    stream_free(stream);
+    jrpc_connection_close(conn);
+    return NULL;
+  }
+  /* produce is first called from flush_cb */
+  jrpc_connection_dirty(conn);
+  return stream;
+}
+
+int jrpc_stream_write(jrpc_stream *stream,
+                      json_t *element) {
+  if( stream->conn->closing || stream->mode == STREAM_RAW ) {
+    return -1;
+  }
+  if( stream_append(stream, stream->mode == STREAM_ARRAY ? "," : "[", 1) ||
+      json_dump_callback(element, dump_cb, stream,
+                         JSON_COMPACT | JSON_ENCODE_ANY |
+                         JSON_PRESERVE_ORDER) != 0 ) {
+    return -1;
+  }
+  stream->mode = STREAM_ARRAY;
+  return stream_size(stream) >= stream->high_water;
+}
+
+int jrpc_stream_write_raw(jrpc_stream *stream,
+                          const char *data,
+                          size_t len) {
+  if( stream->conn->closing || stream->mode == STREAM_ARRAY ||
+      stream_append(stream, data, len) != 0 ) {
+    return -1;
+  }
+  stream->mode = STREAM_RAW;
+  return stream_size(stream) >= stream->high_water;
+}
+
+int jrpc_stream_pump(jrpc_connection *conn) {
+  jrpc_stream *stream = conn->stream;
+  size_t before;
+  int result = 0;
+
+  stream->producing = 1;
+  while( result == 0 && !conn->closing &&
+         stream_size(stream) < stream->high_water ) {
+    before = stream_size(stream);
+    result = stream->produce(stream, stream->data);
+    if( stream_size(stream) == before ) {
+      break;
+    }
+  }
+  stream->producing = 0;
+
+  if( result == 0 && !conn->closing ) {
+    if( stream_flush(stream) == 0 ) {
+      return 0;
+    }
+    /* Aborts the stream */
+    jrpc_connection_close(conn);
+    return 1;
+  }
+
+  if( result == 0 ) {
+    /* Closed while producing, produce sees its writes fail */
+    stream->produce(stream, stream->data);
+  } else if( result > 0 && !conn->closing && stream_end(stream) != 0 ) {
+    result = -1;
+  }
+  stream_free(stream);
+
+  if( !conn->closing &&
+      (result < 0 || (conn->protocol == JRPC_PROTOCOL_HTTP &&
+                      !conn->http_keep_alive)) ) {
+    jrpc_connection_close(conn);
+  }
+  return 1;
+}
+
+void jrpc_stream_abort(jrpc_connection *conn) {
+  jrpc_stream *stream = conn->stream;
+
+  /* A stream closed from its own produce call ends in
+     jrpc_stream_pump */
+  if( stream == NULL || stream->producing ) {
+    return;
+  }
+  stream->producing = 1;
+  stream->produce(stream, stream->data);
+  stream_free(stream);
+}
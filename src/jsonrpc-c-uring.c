@@ -0,0 +1,623 @@
+/*
+ * jsonrpc-c-uring.c
+ *
+ *  io_uring I/O backend.
+ *
+ *  Connections are accepted with a multishot accept and read with a
+ *  multishot receive into a ring of provided buffers. The output
+ *  queued on a connection during one event loop iteration becomes a
+ *  single sendmsg, and all pending submissions go to the kernel in
+ *  one io_uring_enter right before the loop blocks.
+ *
+ *  Completions are signalled on an eventfd watched by the server's
+ *  ev_loop, so procedures run on the loop thread exactly as they do
+ *  with the libev backend.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "jsonrpc-c-internal.h"
+
+#ifdef HAVE_IO_URING
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 1024
+#define URING_BUF_COUNT 256     // must be a power of two
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_IOV_MAX 16
+
+// Operation kinds, stored in the low bits of user_data
+#define URING_OP_MASK 7UL
+enum {
+  URING_OP_NONE = 0,
+  URING_OP_ACCEPT,
+  URING_OP_RECV,
+  URING_OP_SEND
+};
+
+typedef struct uring_conn {
+  int receiving;
+  int sending;
+
+  // arguments of the in-flight sendmsg
+  struct msghdr msg;
+  struct iovec iov[URING_IOV_MAX];
+} uring_conn;
+
+typedef struct {
+  int ring_fd;
+  int event_fd;
+  int listen_fd;
+  int accept_armed;
+
+  void *ring_ptr;
+  size_t ring_len;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags;
+  unsigned sq_entries;
+  unsigned sqe_tail;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_len;
+  char *bufs;
+  unsigned short buf_tail;
+
+  struct ev_io event_watcher;
+  jrpc_server *server;
+} jrpc_uring;
+
+//
+// Ring management
+//
+
+static
+int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static
+int uring_enter(int fd, unsigned to_submit,
+                unsigned min_complete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit,
+                       min_complete, flags, NULL, 0);
+}
+
+static
+int uring_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static
+int uring_submit(jrpc_uring *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned pending = u->sqe_tail - head;
+  int ret;
+
+  if( pending == 0 ) {
+    return 0;
+  }
+  __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+  do {
+    ret = uring_enter(u->ring_fd, pending, 0, 0);
+  } while( ret < 0 && errno == EINTR );
+  return ret < 0 ? -1 : 0;
+}
+
+static
+struct io_uring_sqe* uring_get_sqe(jrpc_uring *u) {
+  struct io_uring_sqe *sqe;
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+  if( u->sqe_tail - head >= u->sq_entries ) {
+    uring_submit(u);
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if( u->sqe_tail - head >= u->sq_entries ) {
+      return NULL;
+    }
+  }
+  sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  u->sqe_tail++;
+  return sqe;
+}
+
+static
+void uring_recycle_buffer(jrpc_uring *u, unsigned short bid) {
+  struct io_uring_buf *buf =
+    &u->buf_ring->bufs[u->buf_tail & (URING_BUF_COUNT - 1)];
+  buf->addr = (uintptr_t) (u->bufs + (size_t) bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  u->buf_tail++;
+  __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+//
+// Connections
+//
+
+static
+void uring_conn_free(jrpc_connection *conn) {
+  free(conn->backend_data);
+  jrpc_connection_free(conn);
+}
+
+/* A connection still listed for flush_cb is freed from there */
+static
+void uring_conn_put(jrpc_connection *conn) {
+  if( --conn->refs == 0 && conn->closing && !conn->dirty ) {
+    uring_conn_free(conn);
+  }
+}
+
+static
+void uring_arm_accept(jrpc_uring *u) {
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  if( sqe == NULL ) {
+    return;   // retried before the loop blocks again
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = u->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = (uintptr_t) u | URING_OP_ACCEPT;
+  u->accept_armed = 1;
+}
+
+static
+int uring_arm_recv(jrpc_uring *u, jrpc_connection *conn) {
+  uring_conn *uc = conn->backend_data;
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  if( sqe == NULL ) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = (uintptr_t) conn | URING_OP_RECV;
+  uc->receiving = 1;
+  conn->refs++;
+  return 0;
+}
+
+static
+int uring_start_send(jrpc_uring *u, jrpc_connection *conn) {
+  uring_conn *uc = conn->backend_data;
+  struct io_uring_sqe *sqe;
+  jrpc_output *out;
+  size_t offset = conn->out_offset;
+  int n = 0;
+
+  for( out = conn->out_head;
+       out != NULL && n < URING_IOV_MAX;
+       out = out->next ) {
+    uc->iov[n].iov_base = (char*) out->data + offset;
+    uc->iov[n].iov_len = out->len - offset;
+    offset = 0;
+    n++;
+  }
+
+  if( (sqe = uring_get_sqe(u)) == NULL ) {
+    return -1;
+  }
+  memset(&uc->msg, 0, sizeof(struct msghdr));
+  uc->msg.msg_iov = uc->iov;
+  uc->msg.msg_iovlen = n;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (uintptr_t) &uc->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t) conn | URING_OP_SEND;
+  conn->out_pinned = n;
+  uc->sending = 1;
+  conn->refs++;
+  return 0;
+}
+
+static
+void uring_cancel_accept(jrpc_uring *u) {
+  struct io_uring_sqe *sqe;
+
+  if( u->accept_armed && (sqe = uring_get_sqe(u)) != NULL ) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) u | URING_OP_ACCEPT;
+    sqe->user_data = URING_OP_NONE;
+  }
+}
+
+static
+void uring_cancel_recv(jrpc_uring *u, jrpc_connection *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  if( sqe == NULL ) {
+    shutdown(conn->fd, SHUT_RD);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uintptr_t) conn | URING_OP_RECV;
+  sqe->user_data = URING_OP_NONE;
+}
+
+//
+// Completions
+//
+
+static
+void uring_on_accept(jrpc_uring *u, struct io_uring_cqe *cqe) {
+  jrpc_connection *conn;
+  uring_conn *uc;
+
+  if( !(cqe->flags & IORING_CQE_F_MORE) ) {
+    u->accept_armed = 0;
+  }
+  if( cqe->res == -EMFILE || cqe->res == -ENFILE ) {
+    /* Re-armed at once it would fail again, round after round */
+    uring_cancel_accept(u);
+    jrpc_accept_pause(u->server, -cqe->res);
+    return;
+  }
+  if( cqe->res < 0 ) {
+    return;
+  }
+
+  conn = jrpc_connection_accept(u->server, cqe->res);
+  if( conn == NULL ) {
+    return;
+  }
+  uc = calloc(1, sizeof(uring_conn));
+  if( uc == NULL ) {
+    jrpc_connection_free(conn);
+    return;
+  }
+  conn->backend_data = uc;
+
+  if( uring_arm_recv(u, conn) != 0 ) {
+    uring_conn_free(conn);
+  }
+}
+
+static
+void uring_on_recv(jrpc_uring *u, jrpc_connection *conn,
+                   struct io_uring_cqe *cqe) {
+  uring_conn *uc = conn->backend_data;
+
+  conn->refs++;   // hold the connection while procedures run
+
+  if( !(cqe->flags & IORING_CQE_F_MORE) ) {
+    uc->receiving = 0;
+    conn->refs--;
+  }
+
+  if( cqe->flags & IORING_CQE_F_BUFFER ) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if( cqe->res > 0 && !conn->closing ) {
+      jrpc_connection_feed(conn,
+                           u->bufs + (size_t) bid * URING_BUF_SIZE,
+                           cqe->res);
+    }
+    uring_recycle_buffer(u, bid);
+  }
+
+  if( cqe->res == 0 ) {
+    jrpc_connection_eof(conn);
+  } else if( cqe->res < 0 && cqe->res != -ENOBUFS ) {
+    /* Error or cancellation */
+    jrpc_connection_close(conn);
+  } else if( !uc->receiving && !conn->closing &&
+             uring_arm_recv(u, conn) != 0 ) {
+    jrpc_connection_close(conn);
+  }
+
+  uring_conn_put(conn);
+}
+
+static
+void uring_on_send(jrpc_uring *u, jrpc_connection *conn,
+                   struct io_uring_cqe *cqe) {
+  uring_conn *uc = conn->backend_data;
+
+  uc->sending = 0;
+  conn->out_pinned = 0;
+
+  if( cqe->res < 0 ) {
+    /* Peer is gone, drop whatever is still queued */
+    jrpc_connection_drop_output(conn);
+    jrpc_connection_close(conn);
+  } else {
+    jrpc_connection_consume(conn, cqe->res);
+    if( conn->out_head != NULL && uring_start_send(u, conn) != 0 ) {
+      jrpc_connection_drop_output(conn);
+      jrpc_connection_close(conn);
+    }
+  }
+
+  uring_conn_put(conn);
+}
+
+static
+void uring_reap(jrpc_uring *u) {
+  struct io_uring_cqe cqe;
+  unsigned head, tail;
+
+  for(;;) {
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    if( head == tail ) {
+      /* Completions the kernel could not post are flushed by
+         entering the ring */
+      if( __atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) &
+          IORING_SQ_CQ_OVERFLOW ) {
+        uring_enter(u->ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+        if( __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) != head ) {
+          continue;
+        }
+      }
+      return;
+    }
+
+    while( head != tail ) {
+      cqe = u->cqes[head & *u->cq_mask];
+      head++;
+      __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+      switch( cqe.user_data & URING_OP_MASK ) {
+      case URING_OP_ACCEPT:
+        uring_on_accept(u, &cqe);
+        break;
+      case URING_OP_RECV:
+        uring_on_recv(u, (jrpc_connection*)
+                      (uintptr_t) (cqe.user_data & ~URING_OP_MASK), &cqe);
+        break;
+      case URING_OP_SEND:
+        uring_on_send(u, (jrpc_connection*)
+                      (uintptr_t) (cqe.user_data & ~URING_OP_MASK), &cqe);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+}
+
+//
+// Event loop integration
+//
+
+static
+void uring_event_cb(struct ev_loop *loop,
+                    struct ev_io *w,
+                    int revents) {
+  jrpc_uring *u = (jrpc_uring*) w->data;
+  eventfd_t value;
+  eventfd_read(u->event_fd, &value);
+  uring_reap(u);
+}
+
+//
+// Backend interface
+//
+
+void jrpc_uring_flush(jrpc_connection *conn) {
+  jrpc_uring *u = conn->server->uring;
+  uring_conn *uc = conn->backend_data;
+
+  conn->refs++;
+  if( !uc->sending && conn->out_head != NULL &&
+      uring_start_send(u, conn) != 0 ) {
+    jrpc_connection_drop_output(conn);
+    jrpc_connection_close(conn);
+  }
+  uring_conn_put(conn);
+}
+
+void jrpc_uring_submit(jrpc_server *server) {
+  jrpc_uring *u = server->uring;
+  if( !u->accept_armed && u->listen_fd >= 0 &&
+      server->accept_paused != 1 ) {
+    uring_arm_accept(u);
+  }
+  uring_submit(u);
+}
+
+void jrpc_uring_stop_accept(jrpc_server *server) {
+  jrpc_uring *u = server->uring;
+
+  u->listen_fd = -1;
+  uring_cancel_accept(u);
+}
+
+/* Queued responses are still flushed; the fd is closed once no
+   operation references the connection any more */
+void jrpc_uring_close(jrpc_connection *conn) {
+  jrpc_uring *u = conn->server->uring;
+  uring_conn *uc = conn->backend_data;
+
+  if( uc->receiving ) {
+    uring_cancel_recv(u, conn);
+  }
+  conn->refs++;
+  uring_conn_put(conn);
+}
+
+static
+void uring_free(jrpc_uring *u) {
+  if( u->ring_fd >= 0 ) {
+    close(u->ring_fd);
+  }
+  if( u->event_fd >= 0 ) {
+    close(u->event_fd);
+  }
+  if( u->ring_ptr != NULL && u->ring_ptr != MAP_FAILED ) {
+    munmap(u->ring_ptr, u->ring_len);
+  }
+  if( u->sqes != NULL && u->sqes != MAP_FAILED ) {
+    munmap(u->sqes, u->sqes_len);
+  }
+  if( u->buf_ring != NULL && u->buf_ring != MAP_FAILED ) {
+    munmap(u->buf_ring, u->buf_ring_len);
+  }
+  free(u->bufs);
+  free(u);
+}
+
+int jrpc_uring_start(jrpc_server *server, int listen_fd) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  jrpc_uring *u;
+  char *ring;
+  size_t sq_len, cq_len;
+  unsigned i;
+
+  if( (u = calloc(1, sizeof(jrpc_uring))) == NULL ) {
+    return -1;
+  }
+  u->server = server;
+  u->listen_fd = listen_fd;
+  u->event_fd = -1;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_CQ_ENTRIES;
+  if( (u->ring_fd = uring_setup(URING_ENTRIES, &p)) < 0 ||
+      !(p.features & IORING_FEAT_SINGLE_MMAP) ) {
+    goto fail;
+  }
+
+  /* Both rings share one mapping */
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+  u->ring_ptr = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                     IORING_OFF_SQ_RING);
+  if( u->ring_ptr == MAP_FAILED ) {
+    goto fail;
+  }
+  ring = u->ring_ptr;
+  u->sq_head = (unsigned*) (ring + p.sq_off.head);
+  u->sq_tail = (unsigned*) (ring + p.sq_off.tail);
+  u->sq_mask = (unsigned*) (ring + p.sq_off.ring_mask);
+  u->sq_flags = (unsigned*) (ring + p.sq_off.flags);
+  u->sq_entries = p.sq_entries;
+  u->sqe_tail = *u->sq_tail;
+  u->cq_head = (unsigned*) (ring + p.cq_off.head);
+  u->cq_tail = (unsigned*) (ring + p.cq_off.tail);
+  u->cq_mask = (unsigned*) (ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*) (ring + p.cq_off.cqes);
+
+  /* SQ slot i always holds SQE i */
+  for( i = 0; i < p.sq_entries; i++ ) {
+    ((unsigned*) (ring + p.sq_off.array))[i] = i;
+  }
+
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                 IORING_OFF_SQES);
+  if( u->sqes == MAP_FAILED ) {
+    goto fail;
+  }
+
+  /* Provided receive buffers */
+  u->buf_ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+  u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  u->bufs = malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+  if( u->buf_ring == MAP_FAILED || u->bufs == NULL ) {
+    goto fail;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) u->buf_ring;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BUF_GROUP;
+  if( uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+    goto fail;
+  }
+  for( i = 0; i < URING_BUF_COUNT; i++ ) {
+    uring_recycle_buffer(u, i);
+  }
+
+  /* Completion notifications for the ev_loop */
+  u->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if( u->event_fd < 0 ||
+      uring_register(u->ring_fd, IORING_REGISTER_EVENTFD,
+                     &u->event_fd, 1) < 0 ) {
+    goto fail;
+  }
+
+  uring_arm_accept(u);
+  if( uring_submit(u) != 0 ) {
+    goto fail;
+  }
+
+  ev_io_init(&u->event_watcher, uring_event_cb, u->event_fd, EV_READ);
+  u->event_watcher.data = u;
+  ev_io_start(server->loop, &u->event_watcher);
+
+  server->uring = u;
+  return 0;
+
+ fail:
+  uring_free(u);
+  return -1;
+}
+
+void jrpc_uring_destroy(jrpc_server *server) {
+  jrpc_uring *u = server->uring;
+  jrpc_connection *conn;
+  if( u == NULL ) {
+    return;
+  }
+  ev_io_stop(server->loop, &u->event_watcher);
+  uring_free(u);
+  server->uring = NULL;
+
+  /* No completion will come for what was in flight; the connections
+     themselves are freed by the caller */
+  for( conn = server->connections; conn != NULL; conn = conn->next ) {
+    if( conn->protocol != JRPC_PROTOCOL_SHM ) {
+      free(conn->backend_data);
+      conn->backend_data = NULL;
+    }
+  }
+}
+
+#else
+
+int jrpc_uring_start(jrpc_server *server, int listen_fd) {
+  return -1;
+}
+
+void jrpc_uring_destroy(jrpc_server *server) {
+}
+
+void jrpc_uring_flush(jrpc_connection *conn) {
+}
+
+void jrpc_uring_submit(jrpc_server *server) {
+}
+
+void jrpc_uring_stop_accept(jrpc_server *server) {
+}
+
+void jrpc_uring_close(jrpc_connection *conn) {
+}
+
+#endif
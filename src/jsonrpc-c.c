@@ -5,7 +5,134 @@
  *      Author: hmng
  */
 
-#include "jsonrpc-c.h"
+#include "jsonrpc-c-internal.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+
+//
+// Local functions
+//
+
+#ifdef DEBUG
+
+static
+char* jrpc_new_vsprintf(const char *fmt, va_list vargs);
+
+static
+char* jrpc_new_sprintf(const char *fmt, ...);
+
+#endif
+
+static
+int send_response(jrpc_connection* connection,
+                  char* response);
+
+static
+int queue_message(jrpc_connection *conn,
+                  jrpc_buffer *buf,
+                  uint32_t key);
+
+static
+void flush_output(jrpc_connection *conn);
+
+static
+void flush_cb(struct ev_loop *loop,
+              struct ev_prepare *w,
+              int revents);
+
+static
+void requeue_cb(struct ev_loop *loop,
+                struct ev_idle *w,
+                int revents);
+
+static
+void write_cb(struct ev_loop *loop,
+              struct ev_io *w,
+              int revents);
+
+static inline
+void send_static_error(jrpc_connection *conn);
+
+static
+int send_error(jrpc_connection *conn,
+               json_int_t code,
+               char *msg,
+               json_t *error_object,
+               json_t *id);
+
+static
+int send_result(jrpc_connection *conn,
+                json_t *result_object,
+                json_t *id);
+
+static
+int invoke_procedure(jrpc_server *server,
+                     jrpc_connection *conn,
+                     const char *name,
+                     json_t *params,
+                     json_t *id);
+
+static
+int eval_request(jrpc_server* server,
+                 jrpc_connection* conn,
+                 json_t* root);
+
+static
+void close_connection(struct ev_loop *loop,
+                      struct ev_io *w);
+
+static
+int handle_buffer(jrpc_connection *conn);
+
+static
+void connection_cb(struct ev_loop *loop,
+                   struct ev_io *w,
+                   int revents);
+
+static
+void accept_cb(struct ev_loop *loop,
+               struct ev_io *w,
+               int revents);
+
+static
+void accept_timer_cb(struct ev_loop *loop,
+                     struct ev_timer *w,
+                     int revents);
+
+static
+void accept_resume(jrpc_server *server);
+
+static
+int __jrpc_server_bind(jrpc_server *server, int *sockfd_out);
+
+static
+void __jrpc_server_sockopt(jrpc_server *server,
+                           int sockfd,
+                           int level,
+                           int name,
+                           int value);
+
+static
+int __jrpc_server_listen(jrpc_server *server, int sockfd);
+
+static
+int __jrpc_server_start(jrpc_server *server);
+
+static
+int __jrpc_register_procedure(jrpc_server *server,
+                              jrpc_function function_pointer,
+                              char *name,
+                              uint32_t name_hash,
+                              void *data,
+                              json_t *schema);
+
+static
+void jrpc_procedure_destroy(jrpc_procedure *procedure);
+
+static
+void jrpc_connection_free_all(jrpc_server *server);
 
 #ifdef DEBUG
 
@@ -38,7 +165,6 @@ void jrpc_clear_error(jrpc_server *server) {
   memset(&server->error, 0, sizeof(jrpc_error));
 }
 
-static
 void jrpc_set_error(jrpc_server *server,
                     int code,
                     const char *cause,
@@ -55,27 +181,315 @@ void jrpc_set_error(jrpc_server *server,
 #endif
 
 //
-// INET4/6
+// Output
 //
 
-// get sockaddr, IPv4 or IPv6:
+jrpc_buffer* jrpc_buffer_new(const char *data, size_t len) {
+  jrpc_buffer *buf = malloc(sizeof(jrpc_buffer) + len);
+  if( buf == NULL ) {
+    return NULL;
+  }
+  buf->refcount = 1;
+  buf->len = len;
+  if( data != NULL ) {
+    memcpy(buf->data, data, len);
+  }
+  return buf;
+}
+
+void jrpc_buffer_unref(jrpc_buffer *buf) {
+  if( --buf->refcount == 0 ) {
+    free(buf);
+  }
+}
+
+/* Applies the server's overflow policy to a notification for a
+   connection above the high-water mark. Returns 1 if buf was
+   coalesced into the queue, 0 if it must be dropped. */
+static
+int overflow_output(jrpc_connection *conn,
+                    jrpc_buffer *buf,
+                    uint32_t key) {
+  jrpc_output *out = conn->out_head;
+  int skip = conn->out_pinned;
+
+  switch( conn->server->overflow_policy ) {
+  case JRPC_OVERFLOW_DROP:
+    return 0;
+  case JRPC_OVERFLOW_COALESCE:
+    /* Entries being sent can not be replaced */
+    if( skip == 0 && conn->out_offset > 0 ) {
+      skip = 1;
+    }
+    for( ; out != NULL; out = out->next ) {
+      if( skip > 0 ) {
+        skip--;
+      } else if( out->key == key ) {
+        conn->out_bytes += buf->len - out->len;
+        buf->refcount++;
+        jrpc_buffer_unref(out->buf);
+        out->buf = buf;
+        out->data = buf->data;
+        out->len = buf->len;
+        return 1;
+      }
+    }
+    return 0;
+  default:
+    jrpc_connection_drop_output(conn);
+    jrpc_connection_close(conn);
+    return 0;
+  }
+}
+
+void jrpc_connection_dirty(jrpc_connection *conn) {
+  jrpc_server *server = conn->server;
+  if( !conn->dirty ) {
+    conn->dirty = 1;
+    conn->next_dirty = server->dirty_head;
+    server->dirty_head = conn;
+  }
+}
+
+int jrpc_connection_queue(jrpc_connection *conn,
+                          jrpc_buffer *buf,
+                          const char *data,
+                          size_t len,
+                          uint32_t key) {
+  jrpc_output *out;
+
+  if( (out = malloc(sizeof(jrpc_output))) == NULL ) {
+    return -1;
+  }
+  buf->refcount++;
+  out->buf = buf;
+  out->data = data;
+  out->len = len;
+  out->key = key;
+  out->next = NULL;
+  if( conn->out_tail != NULL ) {
+    conn->out_tail->next = out;
+  } else {
+    conn->out_head = out;
+  }
+  conn->out_tail = out;
+  conn->out_bytes += len;
+  jrpc_connection_dirty(conn);
+  return 0;
+}
+
+/* Message framing of the raw transport */
+static jrpc_buffer newline_buffer = { 1, 1, { '\n' } };
+
+static
+int queue_message(jrpc_connection *conn,
+                  jrpc_buffer *buf,
+                  uint32_t key) {
+  jrpc_server *server = conn->server;
+
+  if( key != 0 && server->output_high_water > 0 &&
+      conn->out_bytes >= server->output_high_water ) {
+    return overflow_output(conn, buf, key) ? 0 : -1;
+  }
+  if( jrpc_connection_queue(conn, buf, buf->data, buf->len, key) != 0 ) {
+    return -1;
+  }
+  return jrpc_connection_queue(conn, &newline_buffer,
+                               newline_buffer.data, 1, 0);
+}
+
+int jrpc_connection_send(jrpc_connection *conn,
+                         jrpc_buffer *buf,
+                         uint32_t key,
+                         jrpc_buffer **frames) {
+  int result;
+
+  if( conn->closing || conn->stream != NULL ) {
+    /* Nothing can be interleaved with a streamed result */
+    return -1;
+  }
+  if( conn->protocol == JRPC_PROTOCOL_HTTP ) {
+    /* Plain HTTP has no way to push notifications */
+    return key != 0 ? -1 : jrpc_http_send(conn, buf);
+  }
+  if( conn->compress != NULL ) {
+    if( (buf = jrpc_compress_buffer(conn, buf, frames)) == NULL ) {
+      return -1;
+    }
+    result = queue_message(conn, buf, key);
+    jrpc_buffer_unref(buf);
+    return result;
+  }
+  return queue_message(conn, buf, key);
+}
+
+void jrpc_connection_consume(jrpc_connection *conn, size_t len) {
+  jrpc_output *out;
+
+  while( len > 0 && (out = conn->out_head) != NULL ) {
+    size_t left = out->len - conn->out_offset;
+    if( len < left ) {
+      conn->out_offset += len;
+      conn->out_bytes -= len;
+      break;
+    }
+    len -= left;
+    conn->out_bytes -= left;
+    conn->out_offset = 0;
+    conn->out_head = out->next;
+    jrpc_buffer_unref(out->buf);
+    free(out);
+  }
+  if( conn->out_head == NULL ) {
+    conn->out_tail = NULL;
+  }
+  /* Room for more of a streamed result, produced by flush_cb */
+  if( conn->stream != NULL && conn->out_bytes < conn->stream->high_water ) {
+    jrpc_connection_dirty(conn);
+  }
+}
+
+void jrpc_connection_drop_output(jrpc_connection *conn) {
+  jrpc_output **link = &conn->out_head, *out;
+  int keep = conn->out_pinned;
+
+  conn->out_tail = NULL;
+  while( keep-- > 0 && *link != NULL ) {
+    conn->out_tail = *link;
+    link = &(*link)->next;
+  }
+  while( (out = *link) != NULL ) {
+    *link = out->next;
+    conn->out_bytes -= out->len;
+    if( out == conn->out_head ) {
+      conn->out_bytes += conn->out_offset;
+      conn->out_offset = 0;
+    }
+    jrpc_buffer_unref(out->buf);
+    free(out);
+  }
+}
+
+#define JRPC_IOV_MAX 64
+
+/* Writes as much queued output as the socket takes */
 static
-void* get_in_addr(struct sockaddr *sa) {
+void flush_output(jrpc_connection *conn) {
+  struct iovec iov[JRPC_IOV_MAX];
+  jrpc_output *out;
+  ssize_t written;
+  int n, failed = 0;
+
+  while( conn->out_head != NULL ) {
+    size_t offset = conn->out_offset;
+    for( n = 0, out = conn->out_head;
+         out != NULL && n < JRPC_IOV_MAX;
+         out = out->next, n++ ) {
+      iov[n].iov_base = (char*) out->data + offset;
+      iov[n].iov_len = out->len - offset;
+      offset = 0;
+    }
+
+    written = writev(conn->fd, iov, n);
+    if( written < 0 ) {
+      if( errno == EINTR ) {
+        continue;
+      }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+        /* Resumed by write_cb */
+        ev_io_start(conn->server->loop, &conn->write_watcher);
+        return;
+      }
+      jrpc_connection_drop_output(conn);
+      failed = 1;
+      break;
+    }
+    jrpc_connection_consume(conn, written);
+  }
 
-  if (sa->sa_family == AF_INET) {
-    return &(((struct sockaddr_in*) sa)->sin_addr);
+  ev_io_stop(conn->server->loop, &conn->write_watcher);
+  if( failed && !conn->closing ) {
+    return jrpc_connection_close(conn);
+  }
+  /* A dirty connection is still listed for flush_cb, which comes
+     back here */
+  jrpc_connection_release(conn);
+}
+
+static
+void write_cb(struct ev_loop *loop,
+              struct ev_io *w,
+              int revents) {
+  flush_output((jrpc_connection*) w->data);
+}
+
+static
+void flush_cb(struct ev_loop *loop,
+              struct ev_prepare *w,
+              int revents) {
+  jrpc_server *server = (jrpc_server*) w->data;
+  jrpc_connection *conn, *list = server->dirty_head;
+
+  /* Connections that become dirty again below, a stream with room
+     for more above all, wait for the next iteration so one fast
+     reader cannot keep the loop to itself */
+  server->dirty_head = NULL;
+  while( (conn = list) != NULL ) {
+    list = conn->next_dirty;
+    conn->next_dirty = NULL;
+    conn->dirty = 0;
+    if( conn->stream != NULL ) {
+      /* Held until the flush below, which frees a closed connection */
+      conn->refs++;
+      if( jrpc_stream_pump(conn) ) {
+        /* Requests that arrived while the result was streamed */
+        handle_buffer(conn);
+        if( conn->half_closed && conn->stream == NULL ) {
+          jrpc_connection_close(conn);
+        }
+      }
+      conn->refs--;
+    }
+    if( conn->protocol == JRPC_PROTOCOL_SHM ) {
+      jrpc_shm_flush(conn);
+      jrpc_connection_release(conn);
+    } else if( server->backend == JRPC_BACKEND_URING ) {
+      jrpc_uring_flush(conn);
+    } else {
+      flush_output(conn);
+    }
+  }
+
+  if( server->backend == JRPC_BACKEND_URING ) {
+    jrpc_uring_submit(server);
+  }
+  /* An active idle watcher makes the loop poll without blocking */
+  if( server->dirty_head != NULL ) {
+    ev_idle_start(loop, &server->requeue_watcher);
   } else {
-    return &(((struct sockaddr_in6*) sa)->sin6_addr);
+    ev_idle_stop(loop, &server->requeue_watcher);
   }
+}
 
+static
+void requeue_cb(struct ev_loop *loop,
+                struct ev_idle *w,
+                int revents) {
+  /* flush_cb runs again before the loop polls */
 }
 
 static
 int send_response(jrpc_connection *conn,
                   char *response) {
-  return
-    ( write(conn->fd, response, strlen(response) ) > 0 ) &&
-    ( write(conn->fd, "\n", 1) > 0 );
+  jrpc_buffer *buf = jrpc_buffer_new(response, strlen(response));
+  int return_value;
+  if( buf == NULL ) {
+    return 0;
+  }
+  conn->responded = 1;
+  return_value = jrpc_connection_send(conn, buf, 0, NULL) == 0;
+  jrpc_buffer_unref(buf);
+  return return_value;
 }
 
 //
@@ -102,7 +516,7 @@ int send_error(jrpc_connection *conn,
                json_t *error_object,
                json_t *id) {
   int return_value = -1;
-  json_t *json=json_pack("{s:s,s:{s:i,s:s,s:o},s:o}",
+  json_t *json=json_pack("{s:s,s:{s:i,s:s,s:o},s:O}",
                          "jsonrpc","2.0",
                          "error",
                          "code", code,
@@ -129,7 +543,7 @@ int send_result(jrpc_connection *conn,
                 json_t *result_object,
                 json_t *id) {
   int return_value = -1;
-  json_t *json=json_pack("{s:s,s:o,s:o}",
+  json_t *json=json_pack("{s:s,s:o,s:O}",
                          "jsonrpc","2.0",
                          "result", safe_json_ptr(result_object),
                          "id", safe_json_ptr(id));
@@ -155,16 +569,36 @@ int invoke_procedure(jrpc_server *server,
                      json_t *params,
                      json_t *id) {
   json_t *returned = NULL;
-  int procedure_found = 0, result;
+  int result;
+  uint32_t hash = jrpc_name_hash(name);
   jrpc_context ctx;
   memset(&ctx, 0, sizeof(jrpc_context));
+  ctx.connection = conn;
+  ctx.cancel = &conn->cancel;
 
   for( int i=0; i<server->procedure_count; i++) {
-    if( strcmp(server->procedures[i].name, name)==0 ) {
-      procedure_found = 1;
+    if( server->procedures[i].name_hash == hash &&
+        strcmp(server->procedures[i].name, name)==0 ) {
       ctx.data = server->procedures[i].data;
-      returned = server->procedures[i].function(&ctx, params, id);
-      if( ctx.error_code == 0) {
+      /* Bad params never reach the procedure */
+      if( jrpc_schema_check(server->procedures[i].schema,
+                            params, &ctx) == 0 ) {
+        returned = server->procedures[i].function(&ctx, params, id);
+      }
+      if( conn->stream == NULL && ctx.error_code == 0 &&
+          jrpc_cancel_expired(&conn->cancel) ) {
+        /* The client stopped waiting for this result */
+        json_decref(returned);
+        returned = NULL;
+        ctx.error_code = JRPC_DEADLINE_EXCEEDED;
+        ctx.error_msg = strdup("Deadline exceeded");
+      }
+      if( conn->stream != NULL ) {
+        /* The procedure streams its result */
+        json_decref(returned);
+        json_decref(ctx.error_data);
+        result = 0;
+      } else if( ctx.error_code == 0) {
         if( id != NULL ) {
           result=send_result(conn, returned, id);
         } else {
@@ -189,12 +623,28 @@ int invoke_procedure(jrpc_server *server,
                     id);
 }
 
+/* Absolute deadline of a request, 0 if it has none */
+static
+ev_tstamp request_deadline(jrpc_connection *conn,
+                           json_t *root) {
+  ev_tstamp timeout = conn->server->request_timeout;
+  json_t *field = json_object_get(root, "timeout");
+
+  if( json_is_number(field) && json_number_value(field) > 0 &&
+      (timeout == 0 || json_number_value(field) < timeout) ) {
+    timeout = json_number_value(field);
+  }
+  return timeout > 0 ? conn->received + timeout : 0;
+}
+
 static
 int eval_request(jrpc_server* server,
                  jrpc_connection* conn,
                  json_t* root) {
   char *version, *method;
-  json_t *params, *id;
+  json_t *params = NULL, *id = NULL;
+  ev_tstamp deadline;
+  int result;
   if( json_unpack(root, "{s:s,s:s,s?:o,s?:o}",
                   "jsonrpc", &version,
                   "method", &method,
@@ -203,9 +653,24 @@ int eval_request(jrpc_server* server,
     if( version!=NULL &&
         strcmp(version,"2.0")==0 &&
         method!=NULL ) {
-      return invoke_procedure(server, conn,
-                              method,
-                              params, id);
+      deadline = request_deadline(conn, root);
+      /* ev_now stands still while a batch of pipelined requests is
+         evaluated, so read the clock like jrpc_cancel_expired does */
+      if( deadline > 0 && ev_time() >= deadline ) {
+        /* Expired while queued behind other requests */
+        return id == NULL ? 0 : send_error(conn, JRPC_DEADLINE_EXCEEDED,
+                                           "Deadline exceeded", NULL, id);
+      }
+      jrpc_cancel_arm(conn, deadline);
+      result = invoke_procedure(server, conn,
+                                method,
+                                params, id);
+      if( conn->stream != NULL ) {
+        jrpc_cancel_watch(conn);
+      } else {
+        jrpc_cancel_disarm(conn);
+      }
+      return result;
     } else {
       send_error(conn, JRPC_INVALID_REQUEST,
                  "Missing version or method", NULL, NULL);
@@ -220,51 +685,230 @@ static
 void close_connection(struct ev_loop *loop,
                       struct ev_io *w) {
 
-  jrpc_connection *wptr = (jrpc_connection*) w;
-  ev_io_stop(loop, w);
-  close(wptr->fd);
-  free(wptr->buffer);
-  free(wptr);
+  jrpc_connection_close((jrpc_connection*) w);
+
+}
 
+void jrpc_connection_close(jrpc_connection *conn) {
+  if( conn->closing ) {
+    return;
+  }
+  conn->closing = 1;
+  jrpc_group_leave_all(conn);
+  jrpc_cancel_fire(&conn->cancel);
+  jrpc_stream_abort(conn);
+  jrpc_cancel_disarm(conn);
+
+  if( conn->protocol == JRPC_PROTOCOL_SHM ) {
+    jrpc_shm_close(conn);
+  } else if( conn->server->backend == JRPC_BACKEND_URING ) {
+    /* Freed once its in-flight operations complete */
+    return jrpc_uring_close(conn);
+  }
+  ev_io_stop(conn->server->loop, &conn->io);
+  jrpc_connection_release(conn);
 }
 
+void jrpc_connection_eof(jrpc_connection *conn) {
+  if( conn->server->keep_on_half_close && conn->stream != NULL &&
+      !conn->closing ) {
+    /* The client may still be reading: finish the result first */
+    conn->half_closed = 1;
+    if( conn->server->backend != JRPC_BACKEND_URING ) {
+      ev_io_stop(conn->server->loop, &conn->io);
+    }
+    return;
+  }
+  jrpc_connection_close(conn);
+}
+
+/* Frees a closing libev connection once its output is flushed and
+   no running procedure refers to it */
+void jrpc_connection_release(jrpc_connection *conn) {
+  if( conn->closing && conn->refs == 0 &&
+      conn->out_head == NULL && !conn->dirty ) {
+    ev_io_stop(conn->server->loop, &conn->write_watcher);
+    jrpc_connection_free(conn);
+  }
+}
+
+void jrpc_connection_free(jrpc_connection *conn) {
+  if( conn->protocol == JRPC_PROTOCOL_SHM ) {
+    jrpc_shm_free(conn);
+  }
+  jrpc_compress_free(conn);
+  if( conn->prev != NULL ) {
+    conn->prev->next = conn->next;
+  } else {
+    conn->server->connections = conn->next;
+  }
+  if( conn->next != NULL ) {
+    conn->next->prev = conn->prev;
+  }
+  conn->out_pinned = 0;
+  jrpc_connection_drop_output(conn);
+  jrpc_group_leave_all(conn);
+  close(conn->fd);
+  /* That descriptor may be the one a paused accept waits for */
+  accept_resume(conn->server);
+  free(conn->groups);
+  free(conn->buffer);
+  free(conn);
+}
+
+void jrpc_connection_shift(jrpc_connection *conn, size_t len) {
+  memmove(conn->buffer, conn->buffer + len, conn->pos - len);
+  conn->pos -= len;
+  memset(conn->buffer + conn->pos, 0,
+         conn->buffer_size - conn->pos);
+}
+
+void jrpc_connection_eval(jrpc_connection *conn,
+                          const char *data,
+                          size_t len) {
+  json_error_t error;
+  json_t *root;
+
+  if( (root = json_loadb(data, len, 0, &error)) == NULL ) {
+    send_error(conn,
+               JRPC_PARSE_ERROR,
+               "Parse error. Invalid JSON was received by the server.",
+               NULL, NULL);
+    return;
+  }
+  if( json_is_object(root) ) {
+    eval_request(conn->server, conn, root);
+  } else {
+    send_error(conn, JRPC_INVALID_REQUEST,
+               "Invalid Request", NULL, NULL);
+  }
+  json_decref(root);
+}
+
+/* HTTP requests start with an upper case method token, raw JSON-RPC
+   with an object */
+static
+void detect_protocol(jrpc_connection *conn) {
+  int i = 0;
+
+  while( i < conn->pos && strchr(" \t\r\n", conn->buffer[i]) != NULL ) {
+    i++;
+  }
+  if( i == conn->pos ) {
+    return;
+  }
+  if( conn->server->http &&
+      conn->buffer[i] >= 'A' && conn->buffer[i] <= 'Z' ) {
+    conn->protocol = JRPC_PROTOCOL_HTTP;
+  } else {
+    conn->protocol = JRPC_PROTOCOL_RAW;
+  }
+}
+
+/* Returns -1 if the connection was closed, 0 otherwise */
 static
-void handle_buffer(jrpc_connection *conn) {
+int handle_buffer(jrpc_connection *conn) {
   json_error_t error;
-  json_t *root;;
-  
-  if((root = json_loads(conn->buffer,
-                        JSON_DISABLE_EOF_CHECK,
-                        &error)) != NULL) {
-    if(json_is_object(root)) {
-      eval_request(conn->server, conn, root);
+  json_t *root;
+
+  if( conn->protocol == JRPC_PROTOCOL_UNKNOWN ) {
+    detect_protocol(conn);
+  }
+  if( conn->protocol == JRPC_PROTOCOL_HTTP ) {
+    return jrpc_http_handle(conn);
+  }
+
+  while( conn->pos > 0 && !conn->closing && conn->stream == NULL ) {
+
+    if((root = json_loads(conn->buffer,
+                          JSON_DISABLE_EOF_CHECK,
+                          &error)) != NULL) {
+      if(json_is_object(root)) {
+        eval_request(conn->server, conn, root);
+      }
+      json_decref(root);
+
+      /* Shift processed request, discarding it and the whitespace
+         separating it from the next one */
+      int consumed = error.position;
+      while( consumed < conn->pos &&
+             strchr(" \t\r\n", conn->buffer[consumed]) != NULL ) {
+        consumed++;
+      }
+      jrpc_connection_shift(conn, consumed);
+
+    } else {
+
+      // Did we parse the all buffer? If so, just wait for more.
+      // else there was an error before the buffer's end
+      if (error.position != conn->pos) {
+#ifdef DEBUG
+        char *msg=jrpc_new_sprintf("Parse error at %d", error.position);
+        jrpc_set_error(conn->server, -1, "json_loads", msg);
+        free(msg);
+#endif
+        send_error(conn,
+                   JRPC_PARSE_ERROR,
+                   "Parse error. Invalid JSON was received by the server.",
+                   NULL, NULL);
+        close_connection(conn->server->loop, &conn->io);
+        return -1;
+      }
+      break;
     }
-    json_decref(root);
-    
-    /* Shift processed request, discarding it */
-    memmove(conn->buffer, conn->buffer+conn->pos,
-            error.position);
-    conn->pos -= error.position;
-    memset(conn->buffer + conn->pos, 0,
-           conn->buffer_size - conn->pos);
+  }
+  return conn->closing ? -1 : 0;
+}
 
-  } else {
+/* Grows the input buffer until len more bytes (and the terminating
+   NULL) fit after pos */
+static
+int reserve_buffer(jrpc_connection *conn, size_t len) {
+  unsigned int size = conn->buffer_size;
+
+  while( size - conn->pos <= len ) {
+    size *= 2;
+  }
+  if( size == conn->buffer_size ) {
+    return 0;
+  }
 
-    // Did we parse the all buffer? If so, just wait for more.
-    // else there was an error before the buffer's end
-    if (error.position != conn->pos) {
+  char *new_buffer=realloc(conn->buffer, size);
+  if( new_buffer == NULL ) {
 #ifdef DEBUG
-      char *msg=jrpc_new_sprintf("Parse error at %d", error.position);
-      jrpc_set_error(conn->server, -1, "json_loads", msg);
-      free(msg);
+    jrpc_set_error(conn->server, -1, "realloc", "Memory error");
 #endif
-      send_error(conn,
-                 JRPC_PARSE_ERROR,
-                 "Parse error. Invalid JSON was received by the server.",
-                 NULL, NULL);
-      return close_connection(conn->server->loop, &conn->io);
+    return -1;
+  }
+
+  conn->buffer = new_buffer;
+  conn->buffer_size = size;
+  memset(conn->buffer + conn->pos, 0,
+         conn->buffer_size - conn->pos);
+  return 0;
+}
+
+char* jrpc_connection_reserve(jrpc_connection *conn, size_t len) {
+  return reserve_buffer(conn, len) == 0 ? conn->buffer + conn->pos : NULL;
+}
+
+int jrpc_connection_feed(jrpc_connection *conn,
+                         const char *data,
+                         size_t len) {
+  if( conn->compress != NULL ) {
+    if( jrpc_compress_feed(conn, data, len) != 0 ) {
+      close_connection(conn->server->loop, &conn->io);
+      return -1;
     }
+  } else if( reserve_buffer(conn, len) == 0 ) {
+    memcpy(conn->buffer + conn->pos, data, len);
+    conn->pos += len;
+  } else {
+    close_connection(conn->server->loop, &conn->io);
+    return -1;
   }
+  conn->received = ev_now(conn->server->loop);
+  return handle_buffer(conn);
 }
 
 static
@@ -273,38 +917,43 @@ void connection_cb(struct ev_loop *loop,
                    int revents) {
 
   jrpc_connection *conn;
+#ifdef DEBUG
   jrpc_server *server = (jrpc_server*) w->data;
-  size_t bytes_read = 0;
+#endif
+  ssize_t bytes_read = 0;
 
   /* Get our 'subclassed' event watcher */
   conn = (jrpc_connection*) w;
   int fd = conn->fd;
 
-  if (conn->pos >= conn->buffer_size ) {
-
-    conn->buffer_size *= 2;
-    char *new_buffer=realloc(conn->buffer, conn->buffer_size);
-
-    if( new_buffer == NULL ) {
-#ifdef DEBUG
-      jrpc_set_error(server, -1, "realloc", "Memory error");
-#endif
+  if( conn->compress != NULL ) {
+    /* Frames are expanded into the input buffer, not read into it */
+    char data[16384];
+    if( (bytes_read = read(fd, data, sizeof(data))) > 0 ) {
+      conn->refs++;
+      jrpc_connection_feed(conn, data, bytes_read);
+      conn->refs--;
+      jrpc_connection_release(conn);
+      return;
+    }
+  } else {
+    if( (unsigned int) conn->pos + 1 >= conn->buffer_size &&
+        reserve_buffer(conn, conn->buffer_size / 2) != 0 ) {
       return close_connection(loop, w);
     }
 
-    conn->buffer = new_buffer;
-    memset(conn->buffer + conn->pos, 0,
-           conn->buffer_size - conn->pos);
+    // can not fill the entire buffer, string must be NULL terminated
+    int max_read_size = conn->buffer_size - conn->pos - 1;
 
+    bytes_read=read(fd, conn->buffer + conn->pos, max_read_size);
   }
 
-  // can not fill the entire buffer, string must be NULL terminated
-  int max_read_size = conn->buffer_size - conn->pos - 1;
-
-  bytes_read=read(fd, conn->buffer + conn->pos, max_read_size);
-
   if (bytes_read == -1) {
 
+    if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) {
+      return;
+    }
+
     /* We experienced a read error, close the connection */
 
 #ifdef DEBUG
@@ -318,56 +967,176 @@ void connection_cb(struct ev_loop *loop,
   } else if( bytes_read == 0 ) {
 
     /* We reached EOF, close the connection */
-    close_connection(loop, w);
+    jrpc_connection_eof(conn);
 
   } else {
 
     /* We read some bytes, attempt to parse */
     conn->pos += bytes_read;
+    conn->received = ev_now(loop);
+    conn->refs++;
     handle_buffer( conn );
+    conn->refs--;
+    jrpc_connection_release( conn );
 
   }
 
 }
 
+jrpc_connection* jrpc_connection_new(jrpc_server *server, int fd) {
+  jrpc_connection *conn;
+  conn = (jrpc_connection*) calloc(1, sizeof(jrpc_connection));
+  if( conn == NULL ) {
+    return NULL;
+  }
+
+  conn->buffer = calloc(1, 1500);
+  if( conn->buffer == NULL ) {
+    free( conn );
+    return NULL;
+  }
+
+  //copy pointer to struct jrpc_server
+  conn->io.data = server;
+  ev_io_init(&conn->write_watcher, write_cb, fd, EV_WRITE);
+  conn->write_watcher.data = conn;
+  jrpc_cancel_init(conn);
+  conn->fd = fd;
+  conn->buffer_size = 1500;
+  conn->pos = 0;
+  conn->server = server;
+  conn->received = ev_now(server->loop);
+  conn->next = server->connections;
+  if( conn->next != NULL ) {
+    conn->next->prev = conn;
+  }
+  server->connections = conn;
+  return conn;
+}
+
+jrpc_connection* jrpc_connection_accept(jrpc_server *server, int fd) {
+  jrpc_connection *conn;
+
+  __jrpc_server_sockopt(server, fd, IPPROTO_TCP, TCP_NODELAY,
+                        server->listener.nodelay);
+  conn = jrpc_connection_new(server, fd);
+  if( conn == NULL ) {
+#ifdef DEBUG
+    jrpc_set_error(server, -1, "jrpc_connection_accept", "malloc failed");
+#endif
+    close( fd );
+  }
+  /* A retry after running out of descriptors succeeded */
+  if( server->accept_paused == 2 ) {
+    server->accept_paused = 0;
+  }
+  return conn;
+}
+
+void jrpc_accept_pause(jrpc_server *server, int err) {
+  if( server->accept_paused == 1 ) {
+    return;
+  }
+#ifdef DEBUG
+  if( server->accept_paused == 0 ) {
+    jrpc_set_error(server, err, "accept",
+                   "Out of file descriptors, accepting paused");
+  }
+#endif
+  server->accept_paused = 1;
+  if( server->backend == JRPC_BACKEND_LIBEV ) {
+    ev_io_stop(server->loop, &server->listen_watcher);
+  }
+  ev_timer_set(&server->accept_timer, JRPC_ACCEPT_RETRY, 0.);
+  ev_timer_start(server->loop, &server->accept_timer);
+}
+
+/* Accepts again after a pause; io_uring re-arms its accept right
+   before the loop blocks */
+static
+void accept_resume(jrpc_server *server) {
+  if( server->accept_paused != 1 ) {
+    return;
+  }
+  server->accept_paused = 2;
+  ev_timer_stop(server->loop, &server->accept_timer);
+  if( server->backend == JRPC_BACKEND_LIBEV ) {
+    ev_io_start(server->loop, &server->listen_watcher);
+  }
+}
+
+static
+void accept_timer_cb(struct ev_loop *loop,
+                     struct ev_timer *w,
+                     int revents) {
+  accept_resume((jrpc_server*) w->data);
+}
+
+void jrpc_accept_stop(jrpc_server *server) {
+  ev_timer_stop(server->loop, &server->accept_timer);
+  server->accept_paused = 0;
+  if( server->backend == JRPC_BACKEND_URING ) {
+    jrpc_uring_stop_accept(server);
+  } else {
+    ev_io_stop(server->loop, &server->listen_watcher);
+  }
+}
+
+/* Frees the connections still open when the server is destroyed,
+   whatever they are waiting for */
+static
+void jrpc_connection_free_all(jrpc_server *server) {
+  jrpc_connection *conn;
+
+  for( conn = server->connections; conn != NULL; conn = conn->next ) {
+    /* The hold keeps close from freeing it */
+    conn->refs++;
+    jrpc_connection_close(conn);
+  }
+  /* Operations still in flight go down with the ring */
+  jrpc_uring_destroy(server);
+  while( (conn = server->connections) != NULL ) {
+    ev_io_stop(server->loop, &conn->write_watcher);
+    jrpc_connection_free(conn);
+  }
+  server->dirty_head = NULL;
+}
+
 static
 void accept_cb(struct ev_loop *loop,
                struct ev_io *w,
                int revents) {
-  char s[INET6_ADDRSTRLEN];
+  jrpc_server *server = (jrpc_server*) w->data;
   jrpc_connection *connection_watcher;
-  connection_watcher = (jrpc_connection*) malloc(sizeof(jrpc_connection));
-  struct sockaddr_storage their_addr; // connector's address information
-  socklen_t sin_size;
-  sin_size = sizeof(their_addr);
-  connection_watcher->fd =
-    accept(w->fd, (struct sockaddr *) &their_addr,
-           &sin_size);
-  if (connection_watcher->fd == -1) {
-#ifdef DEBUG
-    jrpc_set_error((jrpc_server*)w->data, errno, "accept", NULL);
-#endif
-    free(connection_watcher);
-  } else {
-    //copy pointer to struct jrpc_server
-    connection_watcher->io.data = w->data;
-    connection_watcher->buffer_size = 1500;
-    connection_watcher->buffer = malloc(1500);
-
-    if( connection_watcher->buffer == NULL ){
+  int budget = server->listener.accept_budget;
+  int fd;
+
+  /* Drain the accept queue, but give the loop back to the other
+     connections after accept_budget of them */
+  while( budget-- > 0 ) {
+    fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if( fd == -1 ) {
+      if( errno == EINTR || errno == ECONNABORTED ) {
+        continue;
+      }
+      /* The listener stays readable: wait for a descriptor to free up
+         instead of spinning */
+      if( errno == EMFILE || errno == ENFILE ) {
+        jrpc_accept_pause(server, errno);
+        return;
+      }
 #ifdef DEBUG
-      jrpc_set_error((jrpc_server*)w->data, -1, "accept_cb",
-                     "malloc failed");
+      if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+        jrpc_set_error(server, errno, "accept", NULL);
+      }
 #endif
-      close( connection_watcher->fd );
-      free( connection_watcher );
       return;
     }
 
-    memset(connection_watcher->buffer, 0, 1500);
-
-    connection_watcher->pos = 0;
-    connection_watcher->server = (jrpc_server*) w->data;
+    connection_watcher = jrpc_connection_accept(server, fd);
+    if( connection_watcher == NULL ){
+      continue;
+    }
 
     ev_io_init( &connection_watcher->io,
                 connection_cb,
@@ -393,10 +1162,59 @@ int jrpc_server_init_with_ev_loop(jrpc_server* server,
                                   const char *hostname,
                                   int port_number,
                                   struct ev_loop *loop) {
+  return jrpc_server_init_with_options(server, hostname,
+                                       port_number, loop, NULL);
+}
+
+int jrpc_server_init_with_options(jrpc_server* server,
+                                  const char *hostname,
+                                  int port_number,
+                                  struct ev_loop *loop,
+                                  const jrpc_server_options *options) {
+  int rv;
   memset(server, 0, sizeof(jrpc_server));
   server->loop = loop;
   server->hostname = strdup(hostname);
   server->port_number = port_number;
+  if( options != NULL ) {
+    server->backend = options->backend;
+    server->output_high_water = options->output_high_water;
+    server->overflow_policy = options->overflow_policy;
+    server->http = options->http;
+    server->request_timeout = options->request_timeout;
+    if( options->shm_path != NULL ) {
+      server->shm_path = strdup(options->shm_path);
+    }
+    server->shm_ring_size = options->shm_ring_size;
+    server->listener = options->listener;
+    server->compression = options->compression;
+    server->compress_threshold = options->compress_threshold;
+    server->http_max_body = options->http_max_body;
+    server->keep_on_half_close = options->keep_on_half_close;
+  }
+  if( server->listener.backlog <= 0 ) {
+    server->listener.backlog = SOMAXCONN;
+  }
+  if( server->listener.accept_budget <= 0 ) {
+    server->listener.accept_budget = JRPC_ACCEPT_BUDGET;
+  }
+  if( server->compress_threshold == 0 ) {
+    server->compress_threshold = JRPC_COMPRESS_THRESHOLD;
+  }
+  if( server->http_max_body == 0 ) {
+    server->http_max_body = JRPC_HTTP_MAX_BODY;
+  }
+  if( server->compression != 0 &&
+      jrpc_register_procedure(server, jrpc_compress_negotiate,
+                              "rpc.compress", NULL) != 0 ) {
+    return -1;
+  }
+  ev_prepare_init(&server->flush_watcher, flush_cb);
+  server->flush_watcher.data = server;
+  ev_prepare_start(server->loop, &server->flush_watcher);
+  ev_idle_init(&server->requeue_watcher, requeue_cb);
+  ev_timer_init(&server->accept_timer, accept_timer_cb, 0., 0.);
+  server->accept_timer.data = server;
 
 #ifdef DEBUG
   jrpc_error *err=&server->error;
@@ -405,7 +1223,17 @@ int jrpc_server_init_with_ev_loop(jrpc_server* server,
   memset(err->msg, 0, FIELD_SIZE(jrpc_error,msg));
 #endif
 
-  return __jrpc_server_start(server);
+  if( options != NULL && options->handover_path != NULL &&
+      (rv = jrpc_handover_adopt(server, options)) != 0 ) {
+    return rv;
+  }
+  if( (rv = __jrpc_server_start(server)) != 0 ) {
+    return rv;
+  }
+  if( server->shm_path != NULL && (rv = jrpc_shm_start(server)) != 0 ) {
+    return rv;
+  }
+  return jrpc_handover_start(server);
 }
 
 static
@@ -435,7 +1263,7 @@ int __jrpc_get_addrinfo(jrpc_server *server,
 }
 
 static
-int __jrpc_server_start(jrpc_server *server) {
+int __jrpc_server_bind(jrpc_server *server, int *sockfd_out) {
   int sockfd, yes=1, rv;
   struct addrinfo *servinfo, *p;
 
@@ -448,7 +1276,7 @@ int __jrpc_server_start(jrpc_server *server) {
 
     /* Create the accepting socket */
     if( (sockfd = socket(p->ai_family,
-                         p->ai_socktype,
+                         p->ai_socktype | SOCK_CLOEXEC,
                          p->ai_protocol)) == -1 ) {
 #ifdef DEBUG
       jrpc_set_error(server, errno, "socket", NULL);
@@ -489,7 +1317,49 @@ int __jrpc_server_start(jrpc_server *server) {
   /* All done with this structure */
   freeaddrinfo(servinfo); 
 
-  if (listen(sockfd, 5) == -1) {
+  *sockfd_out = sockfd;
+  return 0;
+}
+
+static
+void __jrpc_server_sockopt(jrpc_server *server,
+                           int sockfd,
+                           int level,
+                           int name,
+                           int value) {
+  if( value != 0 &&
+      setsockopt(sockfd, level, name, &value, sizeof(int)) == -1 ) {
+    /* Tuning only, the listener works without it */
+#ifdef DEBUG
+    jrpc_set_error(server, errno, "setsockopt", NULL);
+#endif
+  }
+}
+
+/* Also applied to a listener taken over from the previous process:
+   listen() again only resizes its queue */
+static
+int __jrpc_server_listen(jrpc_server *server, int sockfd) {
+  jrpc_listener_options *options = &server->listener;
+
+  /* Accepted sockets inherit these, and buffer sizes must be known
+     before the window scale is negotiated */
+  __jrpc_server_sockopt(server, sockfd, SOL_SOCKET, SO_RCVBUF,
+                        options->rcvbuf);
+  __jrpc_server_sockopt(server, sockfd, SOL_SOCKET, SO_SNDBUF,
+                        options->sndbuf);
+  __jrpc_server_sockopt(server, sockfd, IPPROTO_TCP, TCP_NODELAY,
+                        options->nodelay);
+#ifdef TCP_DEFER_ACCEPT
+  __jrpc_server_sockopt(server, sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                        options->defer_accept);
+#endif
+#ifdef TCP_FASTOPEN
+  __jrpc_server_sockopt(server, sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+                        options->fastopen);
+#endif
+
+  if (listen(sockfd, options->backlog) == -1) {
 #ifdef DEBUG    
     char *msg=jrpc_new_sprintf("Error listening on fd:%d port:%d\n",
                                sockfd, server->port_number);
@@ -498,9 +1368,35 @@ int __jrpc_server_start(jrpc_server *server) {
 #endif
     return JRPC_ERROR;
   }
-  
+  return 0;
+}
+
+static
+int __jrpc_server_start(jrpc_server *server) {
+  int sockfd, rv;
+
+  /* A listener taken over from the previous process is already bound */
+  if( (sockfd = jrpc_handover_fd(server, 0)) < 0 &&
+      (rv = __jrpc_server_bind(server, &sockfd)) != 0 ) {
+    return rv;
+  }
+  if( __jrpc_server_listen(server, sockfd) != 0 ) {
+    close(sockfd);
+    return JRPC_ERROR;
+  }
+
   ev_io_init(&server->listen_watcher, accept_cb, sockfd, EV_READ);
   server->listen_watcher.data = server;
+
+  if( server->backend == JRPC_BACKEND_URING &&
+      jrpc_uring_start(server, sockfd) == 0 ) {
+    return 0;
+  }
+
+  /* io_uring unavailable, fall back to libev readiness callbacks;
+     accept_cb accepts until the queue is empty */
+  server->backend = JRPC_BACKEND_LIBEV;
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
   ev_io_start(server->loop, &server->listen_watcher);
   return 0;
 }
@@ -532,6 +1428,23 @@ void jrpc_server_destroy(jrpc_server *server){
   }
   free(server->procedures);
   free(server->hostname);
+  ev_prepare_stop(server->loop, &server->flush_watcher);
+  ev_idle_stop(server->loop, &server->requeue_watcher);
+  ev_timer_stop(server->loop, &server->accept_timer);
+  server->accept_paused = 0;
+  jrpc_connection_free_all(server);
+  jrpc_group_destroy_all(server);
+  jrpc_shm_destroy(server);
+  jrpc_handover_destroy(server);
+}
+
+uint32_t jrpc_name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  while( *name ) {
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619u;
+  }
+  return hash;
 }
 
 static
@@ -544,12 +1457,27 @@ void jrpc_procedure_destroy(jrpc_procedure *procedure){
     free(procedure->data);
     procedure->data = NULL;
   }
+  jrpc_schema_free(procedure->schema);
+  procedure->schema = NULL;
 }
 
-int jrpc_register_procedure(jrpc_server *server,
-                            jrpc_function function_pointer,
-                            char *name,
-                            void *data) {
+static
+int __jrpc_register_procedure(jrpc_server *server,
+                              jrpc_function function_pointer,
+                              char *name,
+                              uint32_t name_hash,
+                              void *data,
+                              json_t *schema) {
+  jrpc_schema *compiled = NULL;
+
+  if( schema != NULL && (compiled = jrpc_schema_compile(schema)) == NULL ) {
+#ifdef DEBUG
+    jrpc_set_error(server, -1, "jrpc_register_procedure",
+                   "Unsupported params schema");
+#endif
+    return -1;
+  }
+
   int i = server->procedure_count++;
 
   if ( server->procedures == NULL ) {
@@ -562,6 +1490,7 @@ int jrpc_register_procedure(jrpc_server *server,
                                    ( sizeof(jrpc_procedure) *
                                      server->procedure_count) );
     if ( ptr == NULL ) {
+      jrpc_schema_free(compiled);
       return -1;
     }
 
@@ -571,14 +1500,45 @@ int jrpc_register_procedure(jrpc_server *server,
 
   if ( name != NULL && function_pointer != NULL ) {
     server->procedures[i].name = strdup(name);
+    server->procedures[i].name_hash = name_hash;
     server->procedures[i].function = function_pointer;
     server->procedures[i].data = data;
+    server->procedures[i].schema = compiled;
     return 0;
   } else { 
+    jrpc_schema_free(compiled);
     return -1;
   }
 }
 
+int jrpc_register_procedure(jrpc_server *server,
+                            jrpc_function function_pointer,
+                            char *name,
+                            void *data) {
+  return __jrpc_register_procedure(server, function_pointer, name,
+                                   name != NULL ? jrpc_name_hash(name) : 0,
+                                   data, NULL);
+}
+
+int jrpc_register_procedure_hashed(jrpc_server *server,
+                                   jrpc_function function_pointer,
+                                   char *name,
+                                   uint32_t name_hash,
+                                   void *data) {
+  return __jrpc_register_procedure(server, function_pointer, name,
+                                   name_hash, data, NULL);
+}
+
+int jrpc_register_procedure_with_schema(jrpc_server *server,
+                                        jrpc_function function_pointer,
+                                        char *name,
+                                        void *data,
+                                        json_t *schema) {
+  return __jrpc_register_procedure(server, function_pointer, name,
+                                   name != NULL ? jrpc_name_hash(name) : 0,
+                                   data, schema);
+}
+
 int jrpc_deregister_procedure(jrpc_server *server, char *name) {
   /* Search the procedure to deregister */
   int found = 0;
@@ -0,0 +1,175 @@
+/*
+ * test.c
+ *
+ *  Helpers shared by the make check programs.
+ */
+
+#include "test.h"
+
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// How long a client waits for the server
+#define TEST_TIMEOUT 5
+
+static int failures = 0;
+
+int test_check(int cond, const char *what, const char *file, int line) {
+  if( !cond ) {
+    fprintf(stderr, "%s:%d: FAIL: %s\n", file, line, what);
+    failures++;
+  }
+  return cond;
+}
+
+static
+int serve(int port,
+          const jrpc_server_options *options,
+          test_setup_fn setup) {
+  jrpc_server server;
+
+  if( jrpc_server_init_with_options(&server, "127.0.0.1", port,
+                                    EV_DEFAULT, options) != 0 ) {
+    perror("jrpc_server_init");
+    return 1;
+  }
+  if( setup != NULL && setup(&server) != 0 ) {
+    jrpc_server_destroy(&server);
+    return 1;
+  }
+  jrpc_server_run(&server);
+  jrpc_server_destroy(&server);
+  return 0;
+}
+
+pid_t test_serve(int port,
+                 const jrpc_server_options *options,
+                 test_setup_fn setup) {
+  pid_t server;
+  int fd, i;
+
+  if( (server = fork()) == 0 ) {
+    _exit(serve(port, options, setup));
+  }
+  if( server == -1 ) {
+    perror("fork");
+    return -1;
+  }
+  for( i = 0; i < TEST_TIMEOUT * 100; i++ ) {
+    if( (fd = test_connect(port)) != -1 ) {
+      close(fd);
+      return server;
+    }
+    if( waitpid(server, NULL, WNOHANG) == server ) {
+      break;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "server on port %d did not start\n", port);
+  kill(server, SIGKILL);
+  waitpid(server, NULL, 0);
+  return -1;
+}
+
+void test_stop(pid_t server) {
+  if( server > 0 ) {
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+  }
+}
+
+int test_connect(int port) {
+  struct sockaddr_in addr;
+  struct timeval timeout = { TEST_TIMEOUT, 0 };
+  int fd;
+
+  if( (fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+int test_write(int fd, const char *data, size_t len) {
+  ssize_t n;
+
+  while( len > 0 ) {
+    if( (n = write(fd, data, len)) < 0 ) {
+      if( errno == EINTR ) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+char* test_receive(int fd) {
+  return test_receive_lines(fd, -1);
+}
+
+char* test_receive_lines(int fd, int count) {
+  size_t len = 0, size = 4096;
+  char *buffer = malloc(size), *grown;
+  ssize_t n;
+
+  while( count != 0 ) {
+    if( len + 1 == size ) {
+      if( (grown = realloc(buffer, size * 2)) == NULL ) {
+        break;
+      }
+      buffer = grown;
+      size *= 2;
+    }
+    if( (n = read(fd, buffer + len, size - len - 1)) < 0 &&
+        errno == EINTR ) {
+      continue;
+    }
+    /* EOF, a reset or the timeout */
+    if( n <= 0 ) {
+      break;
+    }
+    for( ; n > 0; n-- ) {
+      if( buffer[len++] == '\n' && count > 0 ) {
+        count--;
+      }
+    }
+  }
+  buffer[len] = '\0';
+  return buffer;
+}
+
+char* test_exchange(int port, const char *data, int half_close) {
+  char *response;
+  int fd;
+
+  if( (fd = test_connect(port)) == -1 ) {
+    return strdup("");
+  }
+  if( test_write(fd, data, strlen(data)) == 0 && half_close ) {
+    shutdown(fd, SHUT_WR);
+  }
+  response = test_receive(fd);
+  close(fd);
+  return response;
+}
+
+int test_done(const char *name) {
+  if( failures > 0 ) {
+    fprintf(stderr, "%s: %d failed\n", name, failures);
+    return 1;
+  }
+  printf("%s: ok\n", name);
+  return 0;
+}
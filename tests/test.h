@@ -0,0 +1,53 @@
+/*
+ * test.h
+ *
+ *  Helpers shared by the make check programs: a server run in a
+ *  child process, a blocking client, and failure counting.
+ */
+
+#ifndef JSONRPCC_TEST_H_
+#define JSONRPCC_TEST_H_
+
+#include "jsonrpc-c.h"
+
+// Exit status automake reads as a skipped test
+#define TEST_SKIP 77
+
+// Registers the server's procedures; nonzero fails the start
+typedef int
+(*test_setup_fn)(jrpc_server *server);
+
+// Counts and reports a failure unless cond holds; returns cond
+#define CHECK(cond, what) test_check((cond), (what), __FILE__, __LINE__)
+
+int test_check(int cond, const char *what, const char *file, int line);
+
+// Runs a server on port in a child process and waits until it
+// accepts connections. Returns the child, -1 if it did not start.
+pid_t test_serve(int port,
+                 const jrpc_server_options *options,
+                 test_setup_fn setup);
+
+void test_stop(pid_t server);
+
+int test_connect(int port);
+
+int test_write(int fd, const char *data, size_t len);
+
+// Reads until the server closes the connection, or a few seconds
+// pass. Returns a string to free().
+char* test_receive(int fd);
+
+// Reads until count newlines arrived (any number if negative), the
+// server closes the connection, or a few seconds pass. Returns a
+// string to free().
+char* test_receive_lines(int fd, int count);
+
+// Sends data on a new connection, half-closing it afterwards if
+// half_close is set, and returns what came back, as test_receive
+char* test_exchange(int port, const char *data, int half_close);
+
+// Prints the summary; returns the exit status of the program
+int test_done(const char *name);
+
+#endif
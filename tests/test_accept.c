@@ -0,0 +1,145 @@
+/*
+ * test_accept.c
+ *
+ *  Running out of file descriptors: the server, limited to a couple
+ *  of connections, neither spins on the failing accept nor loses the
+ *  clients waiting in the accept queue, which are served as the
+ *  connections ahead of them close. Run on both I/O backends.
+ */
+
+#include "test.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+
+// descriptor limit of both processes, set before the servers start:
+// io_uring does not see a limit lowered later
+#define LIMIT 64
+// connections the server has descriptors for
+#define ROOM 2
+#define CLIENTS 6
+
+static const char *ping =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"ping\",\"id\":1}\n";
+
+static
+json_t* pong(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_string("pong");
+}
+
+/* Fills the descriptor table up to ROOM below the limit */
+static
+int setup(jrpc_server *server) {
+  int fd;
+
+  if( jrpc_register_procedure(server, pong, "ping", NULL) != 0 ) {
+    return -1;
+  }
+  do {
+    fd = open("/dev/null", O_RDONLY);
+  } while( fd != -1 && fd < LIMIT - ROOM );
+  if( fd == -1 ) {
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/* CPU time the process used so far, in clock ticks */
+static
+long cpu_ticks(pid_t pid) {
+  char path[64], stat[1024], *p;
+  unsigned long user = 0, system = 0;
+  FILE *f;
+  int i;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+  if( (f = fopen(path, "r")) == NULL ) {
+    return -1;
+  }
+  p = fgets(stat, sizeof(stat), f);
+  fclose(f);
+  /* utime and stime are the 14th and 15th fields; the command name
+     before them is in parentheses */
+  if( p == NULL || (p = strrchr(stat, ')')) == NULL ) {
+    return -1;
+  }
+  for( i = 2; i < 14 && p != NULL; i++ ) {
+    p = strchr(p + 1, ' ');
+  }
+  if( p == NULL || sscanf(p, " %lu %lu", &user, &system) != 2 ) {
+    return -1;
+  }
+  return user + system;
+}
+
+static
+int answered(int fd) {
+  char *response = test_receive_lines(fd, 1);
+  int found = strstr(response, "\"pong\"") != NULL;
+
+  free(response);
+  return found;
+}
+
+static
+void test_exhausted(int port, pid_t server) {
+  int fd[CLIENTS], i;
+  long before, after;
+
+  for( i = 0; i < CLIENTS; i++ ) {
+    /* The kernel completes the handshakes the server can not accept */
+    if( !CHECK((fd[i] = test_connect(port)) != -1, "connect") ) {
+      while( --i >= 0 ) {
+        close(fd[i]);
+      }
+      return;
+    }
+    test_write(fd[i], ping, strlen(ping));
+  }
+  for( i = 0; i < ROOM; i++ ) {
+    CHECK(answered(fd[i]), "connections within the limit served");
+  }
+
+  before = cpu_ticks(server);
+  sleep(1);
+  after = cpu_ticks(server);
+  if( !CHECK(before >= 0 && after - before < sysconf(_SC_CLK_TCK) / 4,
+             "no spinning while out of descriptors") ) {
+    fprintf(stderr, "  %ld ticks in a second\n", after - before);
+  }
+
+  /* Each closed connection makes room for one waiting in the queue */
+  for( i = 0; i < CLIENTS; i++ ) {
+    if( i >= ROOM ) {
+      CHECK(answered(fd[i]), "queued connection served once room is made");
+    }
+    close(fd[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  jrpc_server_options options;
+  struct rlimit limit;
+  pid_t server;
+  int port;
+
+  getrlimit(RLIMIT_NOFILE, &limit);
+  if( limit.rlim_max < LIMIT ) {
+    return TEST_SKIP;
+  }
+  limit.rlim_cur = LIMIT;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  memset(&options, 0, sizeof(options));
+  for( port = 12312; port <= 12313; port++ ) {
+    /* io_uring falls back to libev where it is not available */
+    options.backend = port == 12312 ? JRPC_BACKEND_LIBEV : JRPC_BACKEND_URING;
+    if( (server = test_serve(port, &options, setup)) == -1 ) {
+      return 1;
+    }
+    test_exhausted(port, server);
+    test_stop(server);
+  }
+  return test_done("test_accept");
+}
@@ -0,0 +1,231 @@
+/*
+ * test_cancel.c
+ *
+ *  Cancellation tokens and deadlines: a client that closes or shuts
+ *  down its sending side cancels its request, unless the server keeps
+ *  half-closed clients; requests past their deadline are answered
+ *  with JRPC_DEADLINE_EXCEEDED, before dispatch if they expired while
+ *  queued.
+ */
+
+#include "test.h"
+
+#include <time.h>
+
+#define PORT 12306
+#define PORT_HALF_CLOSE 12307
+
+// how the last procedure call ended, kept by the server
+static const char *outcome = "none";
+
+static const char *wait_request =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"wait\",\"params\":[3],\"id\":1}\n";
+
+/* Waits params[0] seconds or until the request is cancelled */
+static
+json_t* wait_for(jrpc_context *ctx, json_t *params, json_t *id) {
+  ev_tstamp end = ev_time() + json_number_value(json_array_get(params, 0));
+
+  outcome = "finished";
+  while( ev_time() < end ) {
+    if( jrpc_cancel_poll(ctx->cancel) ) {
+      outcome = "cancelled";
+      break;
+    }
+    usleep(1000);
+  }
+  return json_string(outcome);
+}
+
+/* Blocks the loop for params[0] seconds without polling */
+static
+json_t* busy(jrpc_context *ctx, json_t *params, json_t *id) {
+  usleep(json_number_value(json_array_get(params, 0)) * 1000000);
+  outcome = "busy";
+  return json_string(outcome);
+}
+
+static
+json_t* mark(jrpc_context *ctx, json_t *params, json_t *id) {
+  outcome = "marked";
+  return json_string(outcome);
+}
+
+static
+json_t* last(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_string(outcome);
+}
+
+static
+int produce(jrpc_stream *stream, void *data) {
+  int *next = (int*) data, full = 0;
+  json_t *element;
+
+  while( !full && *next < 50000 ) {
+    element = json_integer((*next)++);
+    full = jrpc_stream_write(stream, element);
+    json_decref(element);
+  }
+  if( full >= 0 && *next < 50000 ) {
+    return 0;
+  }
+  free(next);
+  return full < 0 ? -1 : 1;
+}
+
+static
+json_t* count(jrpc_context *ctx, json_t *params, json_t *id) {
+  int *next = calloc(1, sizeof(int));
+
+  if( jrpc_stream_begin(ctx, id, produce, next) == NULL ) {
+    free(next);
+  }
+  return NULL;
+}
+
+static
+int setup(jrpc_server *server) {
+  if( jrpc_register_procedure(server, wait_for, "wait", NULL) != 0 ||
+      jrpc_register_procedure(server, busy, "busy", NULL) != 0 ||
+      jrpc_register_procedure(server, mark, "mark", NULL) != 0 ||
+      jrpc_register_procedure(server, count, "count", NULL) != 0 ) {
+    return -1;
+  }
+  return jrpc_register_procedure(server, last, "last", NULL);
+}
+
+/* Sends text without half-closing, which would cancel it, and reads
+   lines responses */
+static
+char* call(int port, const char *text, int lines) {
+  char *response;
+  int fd;
+
+  if( (fd = test_connect(port)) == -1 ) {
+    return strdup("");
+  }
+  test_write(fd, text, strlen(text));
+  response = test_receive_lines(fd, lines);
+  close(fd);
+  return response;
+}
+
+/* The outcome of the last call, once the server is free again */
+static
+int last_was(int port, const char *expected) {
+  char *response = test_exchange(port, "{\"jsonrpc\":\"2.0\","
+                                 "\"method\":\"last\",\"id\":1}\n", 1);
+  int found = strstr(response, expected) != NULL;
+
+  if( !found ) {
+    fprintf(stderr, "  expected %s, got %s", expected, response);
+  }
+  free(response);
+  return found;
+}
+
+static
+void test_disconnect(void) {
+  char *response;
+  int fd;
+
+  /* close() sends no more than a FIN */
+  if( !CHECK((fd = test_connect(PORT)) != -1, "connect") ) {
+    return;
+  }
+  test_write(fd, wait_request, strlen(wait_request));
+  usleep(50000);
+  close(fd);
+  CHECK(last_was(PORT, "cancelled"), "close cancels the request");
+
+  if( !CHECK((fd = test_connect(PORT)) != -1, "connect") ) {
+    return;
+  }
+  test_write(fd, wait_request, strlen(wait_request));
+  shutdown(fd, SHUT_WR);
+  response = test_receive(fd);
+  CHECK(strstr(response, "cancelled") != NULL,
+        "half-close cancels the request by default");
+  free(response);
+  close(fd);
+}
+
+static
+void test_deadline(void) {
+  char *response;
+  json_t *json;
+
+  response = call(PORT, "{\"jsonrpc\":\"2.0\",\"method\":\"wait\","
+                  "\"params\":[3],\"timeout\":0.1,\"id\":1}\n", 1);
+  json = json_loads(response, JSON_DISABLE_EOF_CHECK, NULL);
+  CHECK(json_integer_value(json_object_get(json_object_get(json, "error"),
+                                           "code")) == JRPC_DEADLINE_EXCEEDED,
+        "deadline passed during the call");
+  json_decref(json);
+  free(response);
+
+  /* The second request expires behind the first */
+  response = call(PORT, "{\"jsonrpc\":\"2.0\",\"method\":\"busy\","
+                  "\"params\":[0.3],\"id\":1}\n"
+                  "{\"jsonrpc\":\"2.0\",\"method\":\"mark\","
+                  "\"timeout\":0.1,\"id\":2}\n", 2);
+  json = json_loads(strchr(response, '\n') != NULL ?
+                    strchr(response, '\n') + 1 : "", 0, NULL);
+  CHECK(json_integer_value(json_object_get(json, "id")) == 2 &&
+        json_integer_value(json_object_get(json_object_get(json, "error"),
+                                           "code")) == JRPC_DEADLINE_EXCEEDED,
+        "request expired while queued");
+  json_decref(json);
+  free(response);
+  CHECK(last_was(PORT, "busy"), "expired request not dispatched");
+}
+
+static
+void test_half_close(void) {
+  char *response;
+  json_t *json;
+  time_t start;
+
+  response = test_exchange(PORT_HALF_CLOSE,
+                           "{\"jsonrpc\":\"2.0\",\"method\":\"wait\","
+                           "\"params\":[0.2],\"id\":1}\n", 1);
+  CHECK(strstr(response, "finished") != NULL,
+        "half-close kept with keep_on_half_close");
+  free(response);
+
+  /* The stream ends, then the connection */
+  start = time(NULL);
+  response = test_exchange(PORT_HALF_CLOSE,
+                           "{\"jsonrpc\":\"2.0\",\"method\":\"count\","
+                           "\"id\":1}\n", 1);
+  json = json_loads(response, JSON_DISABLE_EOF_CHECK, NULL);
+  CHECK(json_array_size(json_object_get(json, "result")) == 50000,
+        "stream finished after a half-close");
+  CHECK(time(NULL) - start < 3, "closed after the stream");
+  json_decref(json);
+  free(response);
+}
+
+int main(int argc, char **argv) {
+  jrpc_server_options options;
+  pid_t server, keeping;
+
+  memset(&options, 0, sizeof(options));
+  options.output_high_water = 16384;
+  if( (server = test_serve(PORT, &options, setup)) == -1 ) {
+    return 1;
+  }
+  options.keep_on_half_close = 1;
+  if( (keeping = test_serve(PORT_HALF_CLOSE, &options, setup)) == -1 ) {
+    test_stop(server);
+    return 1;
+  }
+
+  test_disconnect();
+  test_deadline();
+  test_half_close();
+
+  test_stop(keeping);
+  test_stop(server);
+  return test_done("test_cancel");
+}
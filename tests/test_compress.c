@@ -0,0 +1,410 @@
+/*
+ * test_compress.c
+ *
+ *  Message compression: each algorithm built in is negotiated, a
+ *  request and a broadcast round-trip as frames, and frames with a
+ *  truncated or oversized header, or a payload that does not match
+ *  it, close the connection instead of being decoded.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "test.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define COMPRESS_DEFLATE 1
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define COMPRESS_ZSTD 1
+#include <zstd.h>
+#endif
+
+#define PORT 12311
+
+// algorithm byte, compressed size, text size
+#define FRAME_HEADER 9
+#define FRAME_TEXT_MAX (1024 * 1024)
+
+// length of the strings sent, well above the compression threshold
+#define VALUE_SIZE 100000
+
+static
+json_t* echo(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_incref(json_array_get(params, 0));
+}
+
+static
+json_t* subscribe(jrpc_context *ctx, json_t *params, json_t *id) {
+  if( jrpc_group_join(ctx->connection, "news") != 0 ) {
+    return NULL;
+  }
+  return json_string("ok");
+}
+
+static
+json_t* publish(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_integer(jrpc_broadcast(ctx->connection->server, "news",
+                                     "news", params));
+}
+
+static
+int setup(jrpc_server *server) {
+  if( jrpc_register_procedure(server, echo, "echo", NULL) != 0 ||
+      jrpc_register_procedure(server, subscribe, "subscribe", NULL) != 0 ) {
+    return -1;
+  }
+  return jrpc_register_procedure(server, publish, "publish", NULL);
+}
+
+static
+void put_uint32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static
+uint32_t get_uint32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+    (uint32_t) p[2] << 8 | p[3];
+}
+
+/* Compresses text into a new frame. Returns its size, 0 on error. */
+static
+size_t compress_frame(int algorithm,
+                      const char *text,
+                      size_t len,
+                      unsigned char **frame) {
+  size_t size = 0;
+
+  switch( algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE: {
+    uLongf n = compressBound(len);
+    if( (*frame = malloc(FRAME_HEADER + n)) == NULL ||
+        compress(*frame + FRAME_HEADER, &n, (const Bytef*) text,
+                 len) != Z_OK ) {
+      free(*frame);
+      return 0;
+    }
+    size = n;
+    break;
+  }
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD: {
+    size_t n = ZSTD_compressBound(len);
+    if( (*frame = malloc(FRAME_HEADER + n)) == NULL ) {
+      return 0;
+    }
+    size = ZSTD_compress(*frame + FRAME_HEADER, n, text, len, 3);
+    if( ZSTD_isError(size) ) {
+      free(*frame);
+      return 0;
+    }
+    break;
+  }
+#endif
+  default:
+    return 0;
+  }
+  (*frame)[0] = algorithm;
+  put_uint32(*frame + 1, size);
+  put_uint32(*frame + 5, len);
+  return FRAME_HEADER + size;
+}
+
+/* Expands a frame's payload into exactly len bytes. Returns 0 on
+   success. */
+static
+int expand_frame(int algorithm,
+                 const unsigned char *in,
+                 size_t in_len,
+                 char *out,
+                 size_t len) {
+  switch( algorithm ) {
+#ifdef COMPRESS_DEFLATE
+  case JRPC_COMPRESSION_DEFLATE: {
+    uLongf n = len;
+    return uncompress((Bytef*) out, &n, in, in_len) == Z_OK &&
+      n == len ? 0 : -1;
+  }
+#endif
+#ifdef COMPRESS_ZSTD
+  case JRPC_COMPRESSION_ZSTD: {
+    size_t n = ZSTD_decompress(out, len, in, in_len);
+    return !ZSTD_isError(n) && n == len ? 0 : -1;
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+static
+int read_exact(int fd, void *data, size_t len) {
+  char *p = data;
+  ssize_t n;
+
+  while( len > 0 ) {
+    if( (n = read(fd, p, len)) <= 0 ) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* The next message, frames expanded, without its newline. Counts the
+   frames it arrived in. Returns a string to free(), NULL on error. */
+static
+char* receive_message(int fd, int *frames) {
+  unsigned char header[FRAME_HEADER], *in = NULL;
+  char *text = malloc(1), *grown;
+  size_t len = 0, in_len, text_len;
+
+  *frames = 0;
+  while( text != NULL && read_exact(fd, header, 1) == 0 ) {
+    if( header[0] == '\n' ) {
+      text[len] = '\0';
+      return text;
+    }
+    if( header[0] != JRPC_COMPRESSION_DEFLATE &&
+        header[0] != JRPC_COMPRESSION_ZSTD ) {
+      /* Plain text */
+      if( (grown = realloc(text, len + 2)) == NULL ) {
+        break;
+      }
+      text = grown;
+      text[len++] = header[0];
+      continue;
+    }
+    if( read_exact(fd, header + 1, FRAME_HEADER - 1) != 0 ) {
+      break;
+    }
+    in_len = get_uint32(header + 1);
+    text_len = get_uint32(header + 5);
+    if( text_len > FRAME_TEXT_MAX ||
+        (grown = realloc(text, len + text_len + 1)) == NULL ) {
+      break;
+    }
+    text = grown;
+    if( (in = malloc(in_len)) == NULL || read_exact(fd, in, in_len) != 0 ||
+        expand_frame(header[0], in, in_len, text + len, text_len) != 0 ) {
+      break;
+    }
+    free(in);
+    in = NULL;
+    len += text_len;
+    (*frames)++;
+  }
+  free(in);
+  free(text);
+  return NULL;
+}
+
+/* The result of the response to request, sent plain or as a frame
+   of algorithm */
+static
+json_t* call(int fd, const char *request, int algorithm, int *frames) {
+  unsigned char *frame;
+  size_t size;
+  char *response;
+  json_t *json, *result;
+
+  if( algorithm == 0 ) {
+    test_write(fd, request, strlen(request));
+  } else if( (size = compress_frame(algorithm, request, strlen(request),
+                                    &frame)) != 0 ) {
+    test_write(fd, (char*) frame, size);
+    free(frame);
+  }
+  if( (response = receive_message(fd, frames)) == NULL ) {
+    return NULL;
+  }
+  json = json_loads(response, 0, NULL);
+  result = json_incref(json_object_get(json, "result"));
+  json_decref(json);
+  free(response);
+  return result;
+}
+
+/* A connection with the algorithm named name negotiated, -1 if the
+   server refused it */
+static
+int negotiated(const char *name) {
+  char request[128];
+  json_t *result;
+  int fd, frames;
+
+  if( (fd = test_connect(PORT)) == -1 ) {
+    return -1;
+  }
+  snprintf(request, sizeof(request),
+           "{\"jsonrpc\":\"2.0\",\"method\":\"rpc.compress\","
+           "\"params\":[\"unknown\",\"%s\"],\"id\":1}\n", name);
+  result = call(fd, request, 0, &frames);
+  if( !json_is_string(result) ||
+      strcmp(json_string_value(result), name) != 0 ) {
+    close(fd);
+    fd = -1;
+  }
+  json_decref(result);
+  return fd;
+}
+
+/* A request echoing a long, repetitive string */
+static
+char* echo_request(const char *method, char **value) {
+  json_t *request;
+  char *text;
+  size_t i;
+
+  *value = malloc(VALUE_SIZE + 1);
+  for( i = 0; i < VALUE_SIZE; i++ ) {
+    (*value)[i] = "abcdefgh"[i % 8];
+  }
+  (*value)[VALUE_SIZE] = '\0';
+  request = json_pack("{s:s,s:s,s:[s],s:i}", "jsonrpc", "2.0",
+                      "method", method, "params", *value, "id", 2);
+  text = json_dumps(request, JSON_COMPACT);
+  json_decref(request);
+  text = realloc(text, strlen(text) + 2);
+  strcat(text, "\n");
+  return text;
+}
+
+static
+void test_round_trip(const char *name, int algorithm) {
+  char *request, *value, *notification;
+  json_t *result, *json;
+  int fd, subscriber, frames;
+
+  if( !CHECK((fd = negotiated(name)) != -1, name) ) {
+    return;
+  }
+  request = echo_request("echo", &value);
+  result = call(fd, request, algorithm, &frames);
+  CHECK(json_is_string(result) &&
+        strcmp(json_string_value(result), value) == 0 && frames == 1,
+        "compressed request and response round-trip");
+  json_decref(result);
+  free(request);
+  free(value);
+  close(fd);
+
+  /* A broadcast reaches a member as a frame */
+  if( !CHECK((subscriber = negotiated(name)) != -1, name) ) {
+    return;
+  }
+  result = call(subscriber, "{\"jsonrpc\":\"2.0\",\"method\":\"subscribe\","
+                "\"id\":1}\n", 0, &frames);
+  json_decref(result);
+  request = echo_request("publish", &value);
+  fd = test_connect(PORT);
+  result = call(fd, request, 0, &frames);
+  CHECK(json_integer_value(result) == 1, "broadcast queued");
+  json_decref(result);
+  close(fd);
+
+  notification = receive_message(subscriber, &frames);
+  json = notification != NULL ? json_loads(notification, 0, NULL) : NULL;
+  CHECK(frames == 1 &&
+        json_is_string(json_array_get(json_object_get(json, "params"), 0)) &&
+        strcmp(json_string_value(json_array_get(json_object_get(json,
+                                                                "params"),
+                                                0)), value) == 0,
+        "compressed broadcast");
+  json_decref(json);
+  free(notification);
+  free(request);
+  free(value);
+  close(subscriber);
+}
+
+/* Sends data, then a plain request; the connection must be closed
+   without an answer */
+static
+void rejects(const char *what,
+             const char *name,
+             const unsigned char *data,
+             size_t len) {
+  static const char *request =
+    "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"x\"],\"id\":3}\n";
+  char *received, c;
+  int fd;
+
+  if( !CHECK((fd = negotiated(name)) != -1, name) ) {
+    return;
+  }
+  test_write(fd, (const char*) data, len);
+  test_write(fd, request, strlen(request));
+  received = test_receive(fd);
+  if( !CHECK(strstr(received, "\"id\"") == NULL &&
+             recv(fd, &c, 1, MSG_DONTWAIT) == 0, what) ) {
+    fprintf(stderr, "  %s: received %s\n", name, received);
+  }
+  free(received);
+  close(fd);
+}
+
+static
+void test_bad_frames(const char *name, int algorithm) {
+  static const char *text =
+    "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"aaaaaaaaaaaaaaaa"
+    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"],\"id\":1}\n";
+  unsigned char header[5] = { algorithm, 0, 0, 0, 16 }, *frame;
+  size_t size;
+
+  /* The request behind it is taken for the rest of the header */
+  rejects("truncated frame header", name, header, sizeof(header));
+
+  if( (size = compress_frame(algorithm, text, strlen(text), &frame)) == 0 ) {
+    CHECK(0, "compress");
+    return;
+  }
+  put_uint32(frame + 5, FRAME_TEXT_MAX + 1);
+  rejects("text size above the frame limit", name, frame, size);
+  put_uint32(frame + 5, strlen(text));
+
+  put_uint32(frame + 1, 1u << 30);
+  rejects("compressed size above the bound", name, frame, size);
+
+  put_uint32(frame + 1, size - FRAME_HEADER - 4);
+  rejects("truncated payload", name, frame, size - 4);
+  put_uint32(frame + 1, size - FRAME_HEADER);
+
+  put_uint32(frame + 5, strlen(text) - 1);
+  rejects("text size short of the payload", name, frame, size);
+  free(frame);
+}
+
+int main(int argc, char **argv) {
+  jrpc_server_options options;
+  pid_t server;
+
+#if !defined(COMPRESS_DEFLATE) && !defined(COMPRESS_ZSTD)
+  return TEST_SKIP;
+#endif
+  memset(&options, 0, sizeof(options));
+  options.compression = JRPC_COMPRESSION_DEFLATE | JRPC_COMPRESSION_ZSTD;
+  if( (server = test_serve(PORT, &options, setup)) == -1 ) {
+    return 1;
+  }
+#ifdef COMPRESS_DEFLATE
+  test_round_trip("deflate", JRPC_COMPRESSION_DEFLATE);
+  test_bad_frames("deflate", JRPC_COMPRESSION_DEFLATE);
+#endif
+#ifdef COMPRESS_ZSTD
+  test_round_trip("zstd", JRPC_COMPRESSION_ZSTD);
+  test_bad_frames("zstd", JRPC_COMPRESSION_ZSTD);
+#endif
+  test_stop(server);
+  return test_done("test_compress");
+}
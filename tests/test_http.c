@@ -0,0 +1,256 @@
+/*
+ * test_http.c
+ *
+ *  HTTP/1.1 request parsing: framing, pipelining, 100 Continue, and
+ *  the requests that are rejected before any body is read.
+ */
+
+#include "test.h"
+
+#define PORT 12301
+#define MAX_BODY 4096
+
+#define HELLO "{\"jsonrpc\":\"2.0\",\"method\":\"sayHello\",\"id\":1}"
+
+static
+json_t* say_hello(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_string("Hello!");
+}
+
+static
+int setup(jrpc_server *server) {
+  return jrpc_register_procedure(server, say_hello, "sayHello", NULL);
+}
+
+/* Number of times part occurs in text */
+static
+int count(const char *text, const char *part) {
+  int n = 0;
+
+  while( (text = strstr(text, part)) != NULL ) {
+    text += strlen(part);
+    n++;
+  }
+  return n;
+}
+
+/* Sends a request head with body and checks the status line of the
+   (first) response */
+static
+void check_status(const char *what,
+                  const char *head,
+                  const char *body,
+                  const char *status) {
+  char *request, *response;
+
+  request = malloc(strlen(head) + strlen(body) + 1);
+  strcpy(request, head);
+  strcat(request, body);
+  response = test_exchange(PORT, request, 0);
+  if( !CHECK(strncmp(response, status, strlen(status)) == 0, what) ) {
+    fprintf(stderr, "  expected \"%s\", got \"%.40s\"\n", status, response);
+  }
+  free(response);
+  free(request);
+}
+
+static
+char* post(const char *body, const char *headers) {
+  char *request, *response;
+
+  request = malloc(strlen(body) + strlen(headers) + 100);
+  sprintf(request, "POST / HTTP/1.1\r\nHost: test\r\n%s"
+          "Content-Length: %zu\r\n\r\n%s", headers, strlen(body), body);
+  response = test_exchange(PORT, request, 0);
+  free(request);
+  return response;
+}
+
+static
+void test_requests(void) {
+  char *response;
+
+  response = post(HELLO, "Connection: close\r\n");
+  CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0, "POST");
+  CHECK(strstr(response, "Content-Length: ") != NULL,
+        "known-length response has a Content-Length");
+  CHECK(strstr(response, "Transfer-Encoding") == NULL,
+        "known-length response is not chunked");
+  CHECK(strstr(response, "Hello!") != NULL, "POST result");
+  free(response);
+
+  response = post("{\"jsonrpc\":\"2.0\",\"method\":\"sayHello\"}",
+                  "Connection: close\r\n");
+  CHECK(strncmp(response, "HTTP/1.1 204 No Content\r\n", 25) == 0,
+        "notification");
+  free(response);
+
+  response = post("{bad", "Connection: close\r\n");
+  CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0 &&
+        strstr(response, "-32700") != NULL, "parse error");
+  free(response);
+
+  response = test_exchange(PORT, "GET / HTTP/1.1\r\n"
+                           "Connection: close\r\n\r\n", 0);
+  CHECK(strncmp(response, "HTTP/1.1 405 Method Not Allowed\r\n", 33) == 0 &&
+        strstr(response, "Allow: POST\r\n") != NULL, "GET");
+  free(response);
+
+  /* HTTP/1.0 closes after the response without being asked */
+  response = test_exchange(PORT, "POST / HTTP/1.0\r\n"
+                           "Content-Length: 44\r\n\r\n" HELLO, 0);
+  CHECK(strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0 &&
+        strstr(response, "Connection: close\r\n") != NULL, "HTTP/1.0");
+  free(response);
+
+  /* A raw request still works on an HTTP server */
+  response = test_exchange(PORT, HELLO "\n", 1);
+  CHECK(strncmp(response, "{", 1) == 0 &&
+        strstr(response, "Hello!") != NULL, "raw request");
+  free(response);
+}
+
+static
+void test_pipelined(void) {
+  const char *request =
+    "POST / HTTP/1.1\r\nContent-Length: 44\r\n\r\n" HELLO
+    "\r\n"
+    "POST / HTTP/1.1\r\nContent-Length: 44\r\n\r\n" HELLO
+    "POST / HTTP/1.1\r\nConnection: close\r\n"
+    "Content-Length: 44\r\n\r\n" HELLO;
+  char *response = test_exchange(PORT, request, 0);
+
+  CHECK(count(response, "HTTP/1.1 200 OK\r\n") == 3, "pipelined requests");
+  free(response);
+}
+
+static
+void test_continue(void) {
+  char *response;
+  char interim[26];
+  ssize_t n;
+  int fd;
+
+  if( !CHECK((fd = test_connect(PORT)) != -1, "connect") ) {
+    return;
+  }
+  test_write(fd, "POST / HTTP/1.1\r\nExpect: 100-continue\r\n"
+             "Connection: close\r\nContent-Length: 44\r\n\r\n", 81);
+  n = read(fd, interim, 25);
+  interim[n > 0 ? n : 0] = '\0';
+  CHECK(strcmp(interim, "HTTP/1.1 100 Continue\r\n\r\n") == 0,
+        "100 Continue before the body");
+
+  /* The body in two pieces */
+  test_write(fd, HELLO, 20);
+  usleep(10000);
+  test_write(fd, HELLO + 20, 24);
+  response = test_receive(fd);
+  CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0,
+        "response after 100 Continue");
+  free(response);
+  close(fd);
+}
+
+static
+void test_body_limit(void) {
+  char head[128], *body, *response;
+
+  /* Exactly http_max_body: the request padded with spaces */
+  body = malloc(MAX_BODY + 1);
+  memset(body, ' ', MAX_BODY);
+  memcpy(body, HELLO, strlen(HELLO));
+  body[MAX_BODY] = '\0';
+  response = post(body, "Connection: close\r\n");
+  CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0,
+        "body of http_max_body bytes");
+  free(response);
+  free(body);
+
+  sprintf(head, "POST / HTTP/1.1\r\nContent-Length: %d\r\n\r\n",
+          MAX_BODY + 1);
+  check_status("body over http_max_body", head, "",
+               "HTTP/1.1 413 Content Too Large\r\n");
+}
+
+static
+void test_content_length(void) {
+  char *response;
+
+  check_status("Content-Length overflow",
+               "POST / HTTP/1.1\r\n"
+               "Content-Length: 99999999999999999999999\r\n\r\n", "",
+               "HTTP/1.1 400 Bad Request\r\n");
+  check_status("negative Content-Length",
+               "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", "",
+               "HTTP/1.1 400 Bad Request\r\n");
+  check_status("Content-Length with trailing junk",
+               "POST / HTTP/1.1\r\nContent-Length: 12abc\r\n\r\n", "",
+               "HTTP/1.1 400 Bad Request\r\n");
+  check_status("empty Content-Length",
+               "POST / HTTP/1.1\r\nContent-Length:\r\n\r\n", "",
+               "HTTP/1.1 400 Bad Request\r\n");
+  check_status("disagreeing Content-Length headers",
+               "POST / HTTP/1.1\r\nContent-Length: 44\r\n"
+               "Content-Length: 45\r\n\r\n", "",
+               "HTTP/1.1 400 Bad Request\r\n");
+
+  response = post(HELLO, "Content-Length: 44\r\nConnection: close\r\n");
+  CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0,
+        "agreeing Content-Length headers");
+  free(response);
+
+  check_status("Content-Length with trailing whitespace",
+               "POST / HTTP/1.1\r\nConnection: close\r\n"
+               "Content-Length: 44 \t\r\n\r\n", HELLO,
+               "HTTP/1.1 200 OK\r\n");
+}
+
+static
+void test_rejected(void) {
+  char *head;
+
+  check_status("chunked request body",
+               "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", "",
+               "HTTP/1.1 411 Length Required\r\n");
+  check_status("request line without a target",
+               "POST\r\nContent-Length: 44\r\n\r\n", "",
+               "HTTP/1.1 400 Bad Request\r\n");
+  check_status("header line without a colon",
+               "POST / HTTP/1.1\r\nContent-Length 44\r\n\r\n", "",
+               "HTTP/1.1 400 Bad Request\r\n");
+  check_status("HTTP/2.0",
+               "POST / HTTP/2.0\r\nContent-Length: 44\r\n\r\n", "",
+               "HTTP/1.1 505 HTTP Version Not Supported\r\n");
+
+  /* A head that never ends */
+  head = malloc(10000);
+  strcpy(head, "POST / HTTP/1.1\r\nX-Padding: ");
+  memset(head + strlen(head), 'x', 9000);
+  head[9028] = '\0';
+  check_status("oversized head", head, "",
+               "HTTP/1.1 431 Request Header Fields Too Large\r\n");
+  free(head);
+}
+
+int main(int argc, char **argv) {
+  jrpc_server_options options;
+  pid_t server;
+
+  memset(&options, 0, sizeof(options));
+  options.http = 1;
+  options.http_max_body = MAX_BODY;
+  if( (server = test_serve(PORT, &options, setup)) == -1 ) {
+    return 1;
+  }
+
+  test_requests();
+  test_pipelined();
+  test_continue();
+  test_body_limit();
+  test_content_length();
+  test_rejected();
+
+  test_stop(server);
+  return test_done("test_http");
+}
@@ -0,0 +1,432 @@
+/*
+ * test_notify.c
+ *
+ *  Notifications, groups and broadcasts: a broadcast queues one
+ *  serialized buffer on every member, each overflow policy treats a
+ *  member above the high-water mark as documented, and members the
+ *  policy disconnects in the middle of a broadcast leave the group
+ *  without disturbing the others.
+ */
+
+#include "test.h"
+#include "jsonrpc-c-internal.h"
+
+#define HIGH_WATER 1024
+#define TICKS 100
+// response that stays queued on a client with a small receive buffer
+#define STALL_SIZE (16 * 1024 * 1024)
+
+#define PORT_DROP 12308
+#define PORT_COALESCE 12309
+#define PORT_DISCONNECT 12310
+
+static
+json_t* subscribe(jrpc_context *ctx, json_t *params, json_t *id) {
+  const char *group = json_string_value(json_array_get(params, 0));
+
+  if( group == NULL || jrpc_group_join(ctx->connection, group) != 0 ) {
+    return NULL;
+  }
+  return json_string("ok");
+}
+
+static
+json_t* unsubscribe(jrpc_context *ctx, json_t *params, json_t *id) {
+  const char *group = json_string_value(json_array_get(params, 0));
+
+  if( group == NULL || jrpc_group_leave(ctx->connection, group) != 0 ) {
+    return NULL;
+  }
+  return json_string("ok");
+}
+
+/* Broadcasts params[1] ticks to the group params[0], then another
+   method. Returns the members they were queued on, summed. */
+static
+json_t* publish(jrpc_context *ctx, json_t *params, json_t *id) {
+  jrpc_server *server = ctx->connection->server;
+  const char *group = json_string_value(json_array_get(params, 0));
+  int n = json_integer_value(json_array_get(params, 1)), i, count = 0;
+  json_t *tick;
+
+  for( i = 0; group != NULL && i < n; i++ ) {
+    tick = json_pack("[i]", i);
+    count += jrpc_broadcast(server, group, "tick", tick);
+    json_decref(tick);
+  }
+  if( n > 0 ) {
+    count += jrpc_broadcast(server, group, "other", NULL);
+  }
+  return json_integer(count);
+}
+
+/* Notifies the caller params[0] times */
+static
+json_t* notify(jrpc_context *ctx, json_t *params, json_t *id) {
+  int n = json_integer_value(json_array_get(params, 0)), i;
+  json_t *tick;
+
+  for( i = 0; i < n; i++ ) {
+    tick = json_pack("[i]", i);
+    jrpc_notify(ctx->connection, "tick", tick);
+    json_decref(tick);
+  }
+  return json_string("ok");
+}
+
+/* Broadcasts to the group params[0] and, before anything is flushed,
+   counts the queue entries it made and the buffers behind them */
+static
+json_t* shared(jrpc_context *ctx, json_t *params, json_t *id) {
+  jrpc_server *server = ctx->connection->server;
+  uint32_t key = jrpc_name_hash("tick");
+  jrpc_buffer *first = NULL;
+  jrpc_connection *conn;
+  jrpc_output *out;
+  int queued = 0, distinct = 0;
+
+  jrpc_broadcast(server, json_string_value(json_array_get(params, 0)),
+                 "tick", NULL);
+  for( conn = server->connections; conn != NULL; conn = conn->next ) {
+    for( out = conn->out_head; out != NULL; out = out->next ) {
+      if( out->key != key ) {
+        continue;
+      }
+      queued++;
+      if( first == NULL ) {
+        first = out->buf;
+        distinct = 1;
+      } else if( out->buf != first ) {
+        distinct++;
+      }
+    }
+  }
+  return json_pack("{s:i,s:i}", "queued", queued, "buffers", distinct);
+}
+
+/* A response much larger than the socket buffers */
+static
+json_t* stall(jrpc_context *ctx, json_t *params, json_t *id) {
+  char *text = malloc(STALL_SIZE + 1);
+  json_t *result;
+
+  memset(text, 'x', STALL_SIZE);
+  text[STALL_SIZE] = '\0';
+  result = json_string(text);
+  free(text);
+  return result;
+}
+
+static
+json_t* ping(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_string("pong");
+}
+
+static
+int setup(jrpc_server *server) {
+  if( jrpc_register_procedure(server, subscribe, "subscribe", NULL) != 0 ||
+      jrpc_register_procedure(server, unsubscribe, "unsubscribe", NULL) != 0 ||
+      jrpc_register_procedure(server, publish, "publish", NULL) != 0 ||
+      jrpc_register_procedure(server, notify, "notify", NULL) != 0 ||
+      jrpc_register_procedure(server, shared, "shared", NULL) != 0 ||
+      jrpc_register_procedure(server, stall, "stall", NULL) != 0 ) {
+    return -1;
+  }
+  return jrpc_register_procedure(server, ping, "ping", NULL);
+}
+
+/* Reads until a response (a line with an id) arrived, the server
+   closes the connection, or a few seconds pass. Returns a string to
+   free(). */
+static
+char* receive_response(int fd) {
+  char *received = strdup(""), *more, *grown;
+
+  while( strstr(received, "\"id\"") == NULL ) {
+    more = test_receive_lines(fd, 1);
+    if( *more == '\0' ||
+        (grown = realloc(received, strlen(received) + strlen(more) + 1))
+        == NULL ) {
+      free(more);
+      break;
+    }
+    received = strcat(grown, more);
+    free(more);
+  }
+  return received;
+}
+
+/* Sends a request on fd and returns what came back up to its
+   response */
+static
+char* request(int fd, const char *method, const char *params) {
+  char text[256];
+
+  snprintf(text, sizeof(text),
+           "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"params\":%s,\"id\":1}\n",
+           method, params);
+  test_write(fd, text, strlen(text));
+  return receive_response(fd);
+}
+
+/* The result of a request on a new connection, a JSON value to
+   json_decref() */
+static
+json_t* call(int port, const char *method, const char *params) {
+  char *response;
+  json_t *json, *result;
+  int fd;
+
+  if( (fd = test_connect(port)) == -1 ) {
+    return NULL;
+  }
+  response = request(fd, method, params);
+  json = json_loads(response, 0, NULL);
+  result = json_incref(json_object_get(json, "result"));
+  json_decref(json);
+  free(response);
+  close(fd);
+  return result;
+}
+
+/* A connection in group, optionally with a small receive buffer */
+static
+int subscriber(int port, const char *group, int slow) {
+  char params[64], *response;
+  int fd, size = 4096;
+
+  if( (fd = test_connect(port)) == -1 ) {
+    return -1;
+  }
+  if( slow ) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+  snprintf(params, sizeof(params), "[\"%s\"]", group);
+  response = request(fd, "subscribe", params);
+  if( strstr(response, "\"ok\"") == NULL ) {
+    close(fd);
+    fd = -1;
+  }
+  free(response);
+  return fd;
+}
+
+/* Parses the lines in received. Stores the numbers of the ticks among
+   them in ticks (up to TICKS) and returns their count. */
+static
+int ticks_in(char *received, int *ticks) {
+  char *line, *end;
+  json_t *json;
+  const char *method;
+  int count = 0;
+
+  for( line = received; *line != '\0'; line = end + 1 ) {
+    if( (end = strchr(line, '\n')) == NULL ) {
+      break;
+    }
+    json = json_loadb(line, end - line, 0, NULL);
+    method = json_string_value(json_object_get(json, "method"));
+    if( method != NULL && strcmp(method, "tick") == 0 && count < TICKS ) {
+      ticks[count++] = json_integer_value(json_array_get(
+                         json_object_get(json, "params"), 0));
+    }
+    json_decref(json);
+  }
+  return count;
+}
+
+/* Nonzero if fd was closed by the server */
+static
+int closed(int fd) {
+  char c;
+  return recv(fd, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+static
+void test_notify(void) {
+  int fd, ticks[TICKS], n;
+  char *received;
+
+  if( !CHECK((fd = test_connect(PORT_DROP)) != -1, "connect") ) {
+    return;
+  }
+  received = request(fd, "notify", "[3]");
+  n = ticks_in(received, ticks);
+  CHECK(n == 3 && ticks[0] == 0 && ticks[1] == 1 && ticks[2] == 2,
+        "notifications arrive in order before the response");
+  free(received);
+  close(fd);
+}
+
+static
+void test_groups(void) {
+  json_t *result;
+  int a, b, c, ticks[TICKS];
+  char *received;
+
+  a = subscriber(PORT_DROP, "shared", 0);
+  b = subscriber(PORT_DROP, "shared", 0);
+  c = subscriber(PORT_DROP, "shared", 0);
+  if( !CHECK(a != -1 && b != -1 && c != -1, "subscribe") ) {
+    return;
+  }
+
+  result = call(PORT_DROP, "shared", "[\"shared\"]");
+  CHECK(json_integer_value(json_object_get(result, "queued")) == 3 &&
+        json_integer_value(json_object_get(result, "buffers")) == 1,
+        "one buffer queued on every member");
+  json_decref(result);
+
+  received = request(b, "unsubscribe", "[\"shared\"]");
+  free(received);
+  result = call(PORT_DROP, "publish", "[\"shared\",1]");
+  CHECK(json_integer_value(result) == 4, "broadcast skips a member that left");
+  json_decref(result);
+
+  received = request(b, "ping", "[]");
+  CHECK(ticks_in(received, ticks) == 0, "member that left gets no more");
+  free(received);
+  received = request(a, "ping", "[]");
+  CHECK(ticks_in(received, ticks) == 2 && ticks[1] == 0,
+        "members get each broadcast");
+  free(received);
+  close(a);
+  close(b);
+  close(c);
+
+  result = call(PORT_DROP, "publish", "[\"nobody\",1]");
+  CHECK(json_integer_value(result) == 0, "broadcast to an empty group");
+  json_decref(result);
+}
+
+/* A subscriber above the high-water mark with each policy */
+static
+void test_overflow(int port) {
+  int fd, ticks[TICKS], n, i, queued, in_order = 1;
+  char *received;
+  json_t *result;
+
+  if( !CHECK((fd = subscriber(port, "ticks", 0)) != -1, "subscribe") ) {
+    return;
+  }
+  result = call(port, "publish", "[\"ticks\",100]");
+  queued = json_integer_value(result);
+  json_decref(result);
+
+  received = request(fd, "ping", "[]");
+  n = ticks_in(received, ticks);
+  for( i = 0; i < n; i++ ) {
+    in_order = in_order && ticks[i] == i;
+  }
+
+  switch( port ) {
+  case PORT_DROP:
+    CHECK(n > 0 && n < TICKS && in_order && queued == n,
+          "drop: the first ticks arrive, the rest are dropped");
+    CHECK(strstr(received, "\"other\"") == NULL,
+          "drop: another method is dropped too");
+    CHECK(strstr(received, "\"pong\"") != NULL, "drop: connection kept");
+    break;
+  case PORT_COALESCE:
+    CHECK(n > 0 && n < TICKS && queued == TICKS,
+          "coalesce: every tick is queued or coalesced");
+    i = 0;
+    while( i < n && ticks[i] != TICKS - 1 ) {
+      i++;
+    }
+    CHECK(i < n, "coalesce: the latest tick replaced a queued one");
+    CHECK(strstr(received, "\"other\"") == NULL,
+          "coalesce: a method with nothing queued is dropped");
+    CHECK(strstr(received, "\"pong\"") != NULL, "coalesce: connection kept");
+    break;
+  default:
+    /* What was queued goes with the connection */
+    CHECK(queued > 0 && queued < TICKS,
+          "disconnect: ticks queued until the high-water mark");
+    CHECK(strstr(received, "\"pong\"") == NULL && closed(fd),
+          "disconnect: connection closed");
+    break;
+  }
+  free(received);
+  close(fd);
+}
+
+/* Two of four members are disconnected by one broadcast */
+static
+void test_disconnect_mid_broadcast(void) {
+  static const char *stall_request =
+    "{\"jsonrpc\":\"2.0\",\"method\":\"stall\",\"id\":1}\n";
+  int fd[4], i, ticks[TICKS];
+  char *received;
+  json_t *result;
+
+  for( i = 0; i < 4; i++ ) {
+    if( !CHECK((fd[i] = subscriber(PORT_DISCONNECT, "mixed", i % 2)) != -1,
+               "subscribe") ) {
+      return;
+    }
+  }
+  /* The slow members' queues fill up with their own responses */
+  test_write(fd[1], stall_request, strlen(stall_request));
+  test_write(fd[3], stall_request, strlen(stall_request));
+  usleep(200000);
+
+  result = call(PORT_DISCONNECT, "publish", "[\"mixed\",1]");
+  CHECK(json_integer_value(result) == 4,
+        "broadcast queued on the members that kept up");
+  json_decref(result);
+  /* Their unsent output drains from the kernel too slowly to wait for
+     their end of file. A member moved into a freed slot is still
+     reached. */
+  result = call(PORT_DISCONNECT, "publish", "[\"mixed\",1]");
+  CHECK(json_integer_value(result) == 4, "group intact after the broadcast");
+  json_decref(result);
+
+  for( i = 0; i < 4; i += 2 ) {
+    received = request(fd[i], "ping", "[]");
+    CHECK(ticks_in(received, ticks) == 2 && ticks[0] == 0 && ticks[1] == 0 &&
+          strstr(received, "\"other\"") != NULL,
+          "member that kept up gets every broadcast");
+    free(received);
+  }
+  for( i = 0; i < 4; i++ ) {
+    close(fd[i]);
+  }
+
+  result = call(PORT_DISCONNECT, "ping", "[]");
+  CHECK(json_is_string(result), "server still answers");
+  json_decref(result);
+}
+
+int main(int argc, char **argv) {
+  jrpc_server_options options;
+  pid_t servers[3];
+  int port;
+
+  memset(&options, 0, sizeof(options));
+  options.output_high_water = HIGH_WATER;
+  for( port = PORT_DROP; port <= PORT_DISCONNECT; port++ ) {
+    options.overflow_policy = port == PORT_DROP ? JRPC_OVERFLOW_DROP :
+                              port == PORT_COALESCE ? JRPC_OVERFLOW_COALESCE :
+                              JRPC_OVERFLOW_DISCONNECT;
+    if( (servers[port - PORT_DROP] = test_serve(port, &options, setup))
+        == -1 ) {
+      while( --port >= PORT_DROP ) {
+        test_stop(servers[port - PORT_DROP]);
+      }
+      return 1;
+    }
+  }
+
+  test_notify();
+  test_groups();
+  for( port = PORT_DROP; port <= PORT_DISCONNECT; port++ ) {
+    test_overflow(port);
+  }
+  test_disconnect_mid_broadcast();
+
+  for( port = PORT_DROP; port <= PORT_DISCONNECT; port++ ) {
+    test_stop(servers[port - PORT_DROP]);
+  }
+  return test_done("test_notify");
+}
@@ -0,0 +1,221 @@
+/*
+ * test_schema.c
+ *
+ *  Parameter schemas: requests they accept and reject, the JSON
+ *  Pointer of each mismatch, schemas refused at registration, and
+ *  the JSON-RPC errors of requests that never reach a procedure.
+ */
+
+#include "test.h"
+
+#define PORT 12302
+
+static const char *greeting_schema =
+  "{\"type\":\"array\",\"prefixItems\":[{\"type\":\"string\"}],"
+  "\"minItems\":1,\"maxItems\":2}";
+
+static const char *range_schema =
+  "{\"type\":\"object\","
+  " \"properties\":{\"n\":{\"type\":\"integer\",\"minimum\":0,"
+  "                       \"exclusiveMaximum\":10},"
+  "               \"unit\":{\"enum\":[\"s\",\"ms\"]},"
+  "               \"tags\":{\"type\":\"array\","
+  "                         \"items\":{\"type\":\"string\",\"maxLength\":3}}},"
+  " \"required\":[\"n\"],"
+  " \"additionalProperties\":false,"
+  " \"title\":\"annotations are ignored\"}";
+
+static
+json_t* ok(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_string("ok");
+}
+
+static
+int register_schema(jrpc_server *server, char *name, const char *text) {
+  json_t *schema = json_loads(text, 0, NULL);
+  int result;
+
+  /* NULL would register without a schema */
+  if( schema == NULL ) {
+    return -1;
+  }
+  result = jrpc_register_procedure_with_schema(server, ok, name, NULL,
+                                               schema);
+  json_decref(schema);
+  return result;
+}
+
+static
+int setup(jrpc_server *server) {
+  if( register_schema(server, "greet", greeting_schema) != 0 ||
+      register_schema(server, "range", range_schema) != 0 ||
+      jrpc_register_procedure_with_schema(server, ok, "nothing", NULL,
+                                          json_false()) != 0 ) {
+    return -1;
+  }
+  return jrpc_register_procedure(server, ok, "free", NULL);
+}
+
+/* A request for method with params, which are omitted if NULL */
+static
+const char* request(const char *method, const char *params) {
+  static char text[512];
+
+  snprintf(text, sizeof(text),
+           "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",%s%s%s\"id\":1}\n",
+           method, params != NULL ? "\"params\":" : "",
+           params != NULL ? params : "", params != NULL ? "," : "");
+  return text;
+}
+
+/* Sends text on a new connection. Returns the first response, NULL
+   if none came. */
+static
+json_t* call(const char *text) {
+  char *response = test_exchange(PORT, text, 1);
+  json_t *json = json_loads(response, JSON_DISABLE_EOF_CHECK, NULL);
+
+  free(response);
+  return json;
+}
+
+static
+void accepts(const char *what, const char *method, const char *params) {
+  json_t *response = call(request(method, params));
+
+  CHECK(json_is_string(json_object_get(response, "result")), what);
+  json_decref(response);
+}
+
+/* Checks the error code of the response to text and, unless path is
+   NULL, the path in its data */
+static
+void fails(const char *what, const char *text, int code, const char *path) {
+  json_t *response = call(text), *error, *data;
+  const char *got;
+
+  error = json_object_get(response, "error");
+  data = json_object_get(error, "data");
+  if( !CHECK(json_integer_value(json_object_get(error, "code")) == code,
+             what) ) {
+    fprintf(stderr, "  expected code %d\n", code);
+  } else if( path != NULL ) {
+    got = json_string_value(json_object_get(data, "path"));
+    if( !CHECK(got != NULL && strcmp(got, path) == 0, what) ) {
+      fprintf(stderr, "  expected path \"%s\", got \"%s\"\n", path,
+              got != NULL ? got : "(none)");
+    }
+  }
+  json_decref(response);
+}
+
+static
+void rejects(const char *what,
+             const char *method,
+             const char *params,
+             const char *path) {
+  fails(what, request(method, params), JRPC_INVALID_PARAMS, path);
+}
+
+static
+void test_accepted(void) {
+  accepts("string", "greet", "[\"Ann\"]");
+  accepts("string and an unchecked element", "greet", "[\"Ann\",7]");
+  accepts("required property only", "range", "{\"n\":0}");
+  accepts("every property", "range",
+          "{\"n\":9,\"unit\":\"ms\",\"tags\":[\"a\",\"abc\"]}");
+  accepts("float equal to an integer", "range", "{\"n\":3.0}");
+  accepts("procedure without a schema", "free", "{\"any\":[1]}");
+  accepts("procedure without a schema or params", "free", NULL);
+}
+
+static
+void test_rejected(void) {
+  rejects("wrong element type", "greet", "[42]", "/0");
+  rejects("too few elements", "greet", "[]", "");
+  rejects("too many elements", "greet", "[\"a\",\"b\",\"c\"]", "");
+  rejects("object instead of array", "greet", "{\"name\":\"Ann\"}", "");
+  rejects("omitted params are null", "greet", NULL, "");
+  rejects("missing property", "range", "{\"unit\":\"s\"}", "/n");
+  rejects("below minimum", "range", "{\"n\":-1}", "/n");
+  rejects("at exclusiveMaximum", "range", "{\"n\":10}", "/n");
+  rejects("fraction", "range", "{\"n\":1.5}", "/n");
+  rejects("not in enum", "range", "{\"n\":1,\"unit\":\"h\"}", "/unit");
+  rejects("nested element", "range", "{\"n\":1,\"tags\":[\"a\",\"abcd\"]}",
+          "/tags/1");
+  rejects("additional property", "range", "{\"n\":1,\"x\":true}", "/x");
+  rejects("escaped key", "range", "{\"n\":1,\"a/b~\":0}", "/a~1b~0");
+  rejects("false schema", "nothing", "[]", "");
+}
+
+/* Requests that fail before a procedure is looked up */
+static
+void test_errors(void) {
+  json_t *response;
+
+  fails("unknown method", request("missing", "[]"),
+        JRPC_METHOD_NOT_FOUND, NULL);
+  fails("wrong version",
+        "{\"jsonrpc\":\"1.0\",\"method\":\"free\",\"id\":1}\n",
+        JRPC_INVALID_REQUEST, NULL);
+  fails("invalid JSON", "{\"jsonrpc\":\"2.0\",]\n", JRPC_PARSE_ERROR, NULL);
+
+  /* The connection is closed after a parse error, so the request
+     behind it is never answered */
+  response = call("{]\n{\"jsonrpc\":\"2.0\",\"method\":\"free\",\"id\":2}\n");
+  CHECK(json_integer_value(json_object_get(json_object_get(response,
+                                                           "error"),
+                                           "code")) == JRPC_PARSE_ERROR,
+        "parse error before a request");
+  json_decref(response);
+}
+
+/* Schemas refused at registration; the server is never run */
+static
+void test_registration(void) {
+  static const char *invalid[] = {
+    "{\"pattern\":\"^a\"}",
+    "{\"type\":\"strings\"}",
+    "{\"type\":[\"string\",1]}",
+    "{\"minItems\":-1}",
+    "{\"required\":\"n\"}",
+    "{\"properties\":{\"n\":{\"oneOf\":[]}}}",
+    "[]",
+    NULL
+  };
+  jrpc_server server;
+  int i;
+
+  if( !CHECK(jrpc_server_init(&server, "127.0.0.1", PORT) == 0,
+             "server for registration") ) {
+    return;
+  }
+  for( i = 0; invalid[i] != NULL; i++ ) {
+    if( !CHECK(register_schema(&server, "bad", invalid[i]) == -1,
+               "unsupported schema refused") ) {
+      fprintf(stderr, "  schema %s\n", invalid[i]);
+    }
+  }
+  CHECK(jrpc_register_procedure_with_schema(&server, ok, "none", NULL,
+                                            NULL) == 0,
+        "NULL schema accepted");
+  CHECK(jrpc_register_procedure_with_schema(&server, ok, "true", NULL,
+                                            json_true()) == 0,
+        "true schema accepted");
+  jrpc_server_destroy(&server);
+}
+
+int main(int argc, char **argv) {
+  pid_t server;
+
+  if( (server = test_serve(PORT, NULL, setup)) == -1 ) {
+    return 1;
+  }
+  test_accepted();
+  test_rejected();
+  test_errors();
+  test_stop(server);
+
+  test_registration();
+  return test_done("test_schema");
+}
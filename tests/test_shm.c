@@ -0,0 +1,248 @@
+/*
+ * test_shm.c
+ *
+ *  Shared-memory transport with the smallest ring: messages of every
+ *  length wrap the rings at every offset, and messages larger than a
+ *  ring go through in pieces. A client that scribbles over the shared
+ *  header must not take the server down.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "test.h"
+
+#ifdef HAVE_MEMFD_CREATE
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#endif
+
+#define PORT 12303
+#define RING_SIZE 4096
+
+// Layout of the mapping, as in jsonrpc-c-shm.c: the header's ring
+// size, each ring's head counter, and the start of the ring data
+#define HEADER_RING_SIZE 8
+#define RING_HEAD(index) (64 + (index) * 192)
+#define DATA_OFFSET 4096
+
+#define ECHO "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"x\"],\"id\":1}\n"
+
+static
+json_t* echo(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_incref(json_array_get(params, 0));
+}
+
+static
+int setup(jrpc_server *server) {
+  return jrpc_register_procedure(server, echo, "echo", NULL);
+}
+
+/* Echoes a string of len bytes. Returns nonzero if it came back
+   intact. */
+static
+int round_trip(jrpc_shm_client *client, int id, size_t len) {
+  json_t *request, *response;
+  char *value, *text, *line;
+  int intact;
+
+  value = malloc(len + 1);
+  for( size_t i = 0; i < len; i++ ) {
+    value[i] = 'a' + (id + i) % 26;
+  }
+  value[len] = '\0';
+  request = json_pack("{s:s,s:s,s:[s],s:i}", "jsonrpc", "2.0",
+                      "method", "echo", "params", value, "id", id);
+  text = json_dumps(request, JSON_COMPACT);
+  json_decref(request);
+
+  line = jrpc_shm_call(client, text, strlen(text));
+  response = line != NULL ? json_loads(line, 0, NULL) : NULL;
+  intact = response != NULL &&
+    json_integer_value(json_object_get(response, "id")) == id &&
+    json_is_string(json_object_get(response, "result")) &&
+    strcmp(json_string_value(json_object_get(response, "result")),
+           value) == 0;
+
+  json_decref(response);
+  free(line);
+  free(text);
+  free(value);
+  return intact;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+
+/* The handshake of jrpc_shm_connect, without trusting the server.
+   Returns the control socket, and the mapping and the server's
+   eventfd in map and wake_fd. */
+static
+int raw_connect(const char *path, char **map, int *wake_fd) {
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char byte, control[CMSG_SPACE(3 * sizeof(int))];
+  int sock, fds[3];
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+    return -1;
+  }
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if( connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+      recvmsg(sock, &msg, 0) != 1 ||
+      (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+      cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)) ) {
+    close(sock);
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  *map = mmap(NULL, DATA_OFFSET + 2 * RING_SIZE, PROT_READ | PROT_WRITE,
+              MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  close(fds[2]);
+  *wake_fd = fds[1];
+  if( *map == MAP_FAILED ) {
+    close(*wake_fd);
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Queues a request in the client's ring and wakes the server */
+static
+void raw_send(char *map, int wake_fd, const char *text) {
+  memcpy(map + DATA_OFFSET, text, strlen(text));
+  __atomic_store_n((uint64_t*) (map + RING_HEAD(0)), strlen(text),
+                   __ATOMIC_RELEASE);
+  eventfd_write(wake_fd, 1);
+}
+
+/* Nonzero once the server closed the control socket */
+static
+int raw_closed(int sock) {
+  struct pollfd fd = { sock, POLLIN, 0 };
+  char byte;
+
+  return poll(&fd, 1, 5000) == 1 && recv(sock, &byte, 1, 0) == 0;
+}
+
+/* A client that rewrites the ring size after the handshake is still
+   answered in the rings the server set up */
+static
+void test_ring_size(const char *path) {
+  char *map, *response;
+  uint64_t head;
+  int sock, wake_fd, i;
+
+  if( !CHECK((sock = raw_connect(path, &map, &wake_fd)) != -1,
+             "handshake") ) {
+    return;
+  }
+  *(uint64_t*) (map + HEADER_RING_SIZE) = (uint64_t) 1 << 40;
+  raw_send(map, wake_fd, ECHO);
+
+  for( i = 0; i < 5000; i++ ) {
+    if( (head = __atomic_load_n((uint64_t*) (map + RING_HEAD(1)),
+                                __ATOMIC_ACQUIRE)) > 0 &&
+        map[DATA_OFFSET + RING_SIZE + head - 1] == '\n' ) {
+      break;
+    }
+    usleep(1000);
+  }
+  response = map + DATA_OFFSET + RING_SIZE;
+  CHECK(head > 0 && head < RING_SIZE &&
+        memmem(response, head, "\"result\":\"x\"", 12) != NULL,
+        "answered after the ring size was rewritten");
+
+  munmap(map, DATA_OFFSET + 2 * RING_SIZE);
+  close(wake_fd);
+  close(sock);
+}
+
+/* A head counter beyond the ring ends the connection */
+static
+void test_ring_head(const char *path) {
+  char *map;
+  int sock, wake_fd;
+
+  if( !CHECK((sock = raw_connect(path, &map, &wake_fd)) != -1,
+             "handshake") ) {
+    return;
+  }
+  __atomic_store_n((uint64_t*) (map + RING_HEAD(0)), (uint64_t) 1 << 40,
+                   __ATOMIC_RELEASE);
+  eventfd_write(wake_fd, 1);
+  CHECK(raw_closed(sock), "closed after a head out of range");
+
+  munmap(map, DATA_OFFSET + 2 * RING_SIZE);
+  close(wake_fd);
+  close(sock);
+}
+
+#endif
+
+int main(int argc, char **argv) {
+#ifdef HAVE_MEMFD_CREATE
+  jrpc_server_options options;
+  jrpc_shm_client *client;
+  char path[64];
+  pid_t server;
+  int id = 0, intact = 1;
+  size_t len;
+
+  snprintf(path, sizeof(path), "/tmp/jsonrpc-c-test-%d.sock",
+           (int) getpid());
+  memset(&options, 0, sizeof(options));
+  options.shm_path = path;
+  options.shm_ring_size = RING_SIZE;
+  if( (server = test_serve(PORT, &options, setup)) == -1 ) {
+    return 1;
+  }
+  if( !CHECK((client = jrpc_shm_connect(path)) != NULL, "connect") ) {
+    test_stop(server);
+    return test_done("test_shm");
+  }
+
+  /* Lengths that do not divide the ring move the wrap point on
+     every message; the rings wrap some fifty times */
+  for( len = 1; len < RING_SIZE && intact; len += 37 ) {
+    intact = round_trip(client, ++id, len);
+  }
+  CHECK(intact, "messages up to a ring long");
+
+  for( len = RING_SIZE - 64; len < RING_SIZE + 64 && intact; len++ ) {
+    intact = round_trip(client, ++id, len);
+  }
+  CHECK(intact, "messages about a ring long");
+
+  CHECK(round_trip(client, ++id, 5 * RING_SIZE + 123),
+        "message of several rings");
+  CHECK(round_trip(client, ++id, 1), "message after a large one");
+
+  test_ring_size(path);
+  test_ring_head(path);
+  CHECK(round_trip(client, ++id, 100), "message after hostile clients");
+
+  jrpc_shm_disconnect(client);
+  test_stop(server);
+  unlink(path);
+  return test_done("test_shm");
+#else
+  /* Built without the shared-memory transport */
+  return TEST_SKIP;
+#endif
+}
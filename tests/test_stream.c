@@ -0,0 +1,204 @@
+/*
+ * test_stream.c
+ *
+ *  Streamed results many times the high-water mark: the elements
+ *  arrive intact and in order, requests pipelined behind a stream
+ *  are answered after it, and HTTP gets the framing of its version.
+ *  Run on both I/O backends.
+ */
+
+#include "test.h"
+
+#define HIGH_WATER 16384
+#define COUNT 100000
+
+static int port;
+
+typedef struct {
+  int next;
+  int count;
+} counter;
+
+/* Writes the integers up to count, a high-water mark at a time */
+static
+int produce(jrpc_stream *stream, void *data) {
+  counter *c = (counter*) data;
+  json_t *element;
+  int full = 0;
+
+  while( !full && c->next < c->count ) {
+    element = json_integer(c->next++);
+    full = jrpc_stream_write(stream, element);
+    json_decref(element);
+    if( full < 0 ) {
+      free(c);
+      return -1;
+    }
+  }
+  if( c->next < c->count ) {
+    return 0;
+  }
+  free(c);
+  return 1;
+}
+
+static
+json_t* count(jrpc_context *ctx, json_t *params, json_t *id) {
+  counter *c = calloc(1, sizeof(counter));
+
+  c->count = json_integer_value(json_array_get(params, 0));
+  if( jrpc_stream_begin(ctx, id, produce, c) == NULL ) {
+    free(c);
+  }
+  return NULL;
+}
+
+static
+json_t* say_hello(jrpc_context *ctx, json_t *params, json_t *id) {
+  return json_string("Hello!");
+}
+
+static
+int setup(jrpc_server *server) {
+  if( jrpc_register_procedure(server, count, "count", NULL) != 0 ) {
+    return -1;
+  }
+  return jrpc_register_procedure(server, say_hello, "sayHello", NULL);
+}
+
+/* Nonzero if result is the array 0, 1, ..., n - 1 */
+static
+int counted(json_t *result, int n) {
+  size_t i;
+  json_t *element;
+
+  if( !json_is_array(result) || json_array_size(result) != (size_t) n ) {
+    return 0;
+  }
+  json_array_foreach(result, i, element) {
+    if( json_integer_value(element) != (json_int_t) i ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static
+void test_raw(void) {
+  char request[256], *response, *second;
+  json_t *json;
+  int fd;
+
+  snprintf(request, sizeof(request),
+           "{\"jsonrpc\":\"2.0\",\"method\":\"count\",\"params\":[%d],\"id\":1}\n"
+           "{\"jsonrpc\":\"2.0\",\"method\":\"sayHello\",\"id\":2}\n", COUNT);
+  /* Not half-closed: an end of file cancels the stream */
+  if( !CHECK((fd = test_connect(port)) != -1, "connect") ) {
+    return;
+  }
+  test_write(fd, request, strlen(request));
+  response = test_receive_lines(fd, 2);
+  close(fd);
+
+  CHECK(strlen(response) > 10 * HIGH_WATER,
+        "result many times the high-water mark");
+  json = json_loads(response, JSON_DISABLE_EOF_CHECK, NULL);
+  CHECK(json_integer_value(json_object_get(json, "id")) == 1 &&
+        counted(json_object_get(json, "result"), COUNT),
+        "streamed elements intact and in order");
+  json_decref(json);
+
+  /* The pipelined request comes after the whole stream */
+  second = strchr(response, '\n');
+  json = second != NULL ? json_loads(second + 1, 0, NULL) : NULL;
+  CHECK(json_integer_value(json_object_get(json, "id")) == 2 &&
+        json_is_string(json_object_get(json, "result")),
+        "request pipelined behind a stream answered after it");
+  json_decref(json);
+  free(response);
+}
+
+/* Decodes a chunked body in place. Returns its length, -1 if the
+   framing is broken or the last chunk is missing. */
+static
+long dechunk(char *body) {
+  char *in = body, *out = body, *end;
+  unsigned long size;
+
+  for(;;) {
+    size = strtoul(in, &end, 16);
+    if( end == in || strncmp(end, "\r\n", 2) != 0 ) {
+      return -1;
+    }
+    in = end + 2;
+    if( size == 0 ) {
+      return strcmp(in, "\r\n") == 0 ? out - body : -1;
+    }
+    if( strlen(in) < size + 2 || strncmp(in + size, "\r\n", 2) != 0 ) {
+      return -1;
+    }
+    memmove(out, in, size);
+    out += size;
+    in += size + 2;
+  }
+}
+
+static
+void test_http(int minor) {
+  char call[128], request[256], *response, *body;
+  json_t *json = NULL;
+  long len;
+
+  snprintf(call, sizeof(call),
+           "{\"jsonrpc\":\"2.0\",\"method\":\"count\",\"params\":[%d],\"id\":1}",
+           COUNT);
+  snprintf(request, sizeof(request),
+           "POST / HTTP/1.%d\r\nConnection: close\r\n"
+           "Content-Length: %zu\r\n\r\n%s", minor, strlen(call), call);
+  response = test_exchange(port, request, 0);
+  body = strstr(response, "\r\n\r\n");
+
+  if( minor == 1 ) {
+    CHECK(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0 &&
+          strstr(response, "Transfer-Encoding: chunked\r\n") != NULL,
+          "HTTP/1.1 stream is chunked");
+    len = body != NULL ? dechunk(body + 4) : -1;
+    CHECK(len > 0, "HTTP/1.1 chunks well formed");
+    if( len > 0 ) {
+      json = json_loadb(body + 4, len, 0, NULL);
+    }
+  } else {
+    CHECK(strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0 &&
+          strstr(response, "Transfer-Encoding") == NULL &&
+          strstr(response, "Content-Length") == NULL,
+          "HTTP/1.0 stream is delimited by the close");
+    if( body != NULL ) {
+      json = json_loads(body + 4, 0, NULL);
+    }
+  }
+  CHECK(counted(json_object_get(json, "result"), COUNT),
+        minor == 1 ? "HTTP/1.1 streamed result" : "HTTP/1.0 streamed result");
+  json_decref(json);
+  free(response);
+}
+
+int main(int argc, char **argv) {
+  jrpc_server_options options;
+  pid_t server;
+
+  memset(&options, 0, sizeof(options));
+  options.http = 1;
+  options.output_high_water = HIGH_WATER;
+  for( port = 12304; port <= 12305; port++ ) {
+    /* io_uring falls back to libev where it is not available */
+    options.backend = port == 12304 ? JRPC_BACKEND_LIBEV : JRPC_BACKEND_URING;
+    if( (server = test_serve(port, &options, setup)) == -1 ) {
+      return 1;
+    }
+    test_raw();
+    test_http(1);
+    test_http(0);
+    test_stop(server);
+  }
+  return test_done("test_stream");
+}